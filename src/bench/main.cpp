@@ -0,0 +1,223 @@
+#define WIN32_LEAN_AND_MEAN
+
+#include <array>
+#include <chrono>
+#include <format>
+#include <memory>
+#include <string>
+#include <vector>
+#include <iostream>
+#include <functional>
+#include <string_view>
+
+#include <logger.hpp>
+#include <winnet.hpp>
+#include <loopback.hpp>
+
+// throughput of the framing and dispatch in ConnectionHandler::tick over a LoopbackTransport
+// no kernel is involved, so the numbers are the cost of winnet alone and comparable between changes
+// bench [<case>], without a case every case runs
+
+namespace {
+
+inline constexpr uint16_t BENCH_PORT = 8000;
+// a run that takes more ticks than this is stuck, not slow
+inline constexpr int MAX_TICKS = 10'000'000;
+inline constexpr size_t BROADCAST_CLIENTS = 32;
+
+const auto NO_WAIT = timeval{
+  .tv_sec = 0,
+  .tv_usec = 0,
+};
+
+// tick every handler until `is_done`, false when a tick fails or it takes too long
+auto run_until(const std::vector<winnet::ConnectionHandler *> &handlers, const std::function<bool()> &is_done) -> bool {
+  for (auto i = 0; i < MAX_TICKS; ++i) {
+    if (is_done()) {
+      return true;
+    }
+    for (auto handler : handlers) {
+      if (!handler->tick(NO_WAIT)) {
+        return false;
+      }
+    }
+  }
+  return is_done();
+}
+
+auto report(std::string_view name, size_t messages, size_t bytes, std::chrono::steady_clock::duration elapsed)
+  -> void {
+  const auto seconds = std::chrono::duration<double>(elapsed).count();
+  std::cout << std::format("{:<24} {:>9} msgs {:>9.1f} ms {:>12.0f} msgs/s {:>9.1f} MiB/s\n", name, messages,
+                           seconds * 1000.0, static_cast<double>(messages) / seconds,
+                           static_cast<double>(bytes) / seconds / (1024.0 * 1024.0));
+}
+
+struct BenchServer {
+  winnet::Server server;
+  winnet::ConnectionHandler handler;
+
+  explicit BenchServer(winnet::LoopbackTransport &loop) : server{}, handler{&server} {
+    server.transport = &loop;
+    if (!server.init(BENCH_PORT) || !server.listen()) {
+      std::cerr << "bench server could not listen\n";
+    }
+    handler.init();
+  }
+};
+
+// a peer whose bytes are put straight into the receive queue of the server side, the server has accepted it
+auto accept_peer(winnet::LoopbackTransport &loop, BenchServer &server) -> SOCKET {
+  auto addr = SOCKADDR_IN{};
+  if (loop.connect("127.0.0.1", std::to_string(BENCH_PORT), addr) == INVALID_SOCKET ||
+      !run_until({&server.handler}, [&]() { return server.server.connections.size() == 1; })) {
+    return INVALID_SOCKET;
+  }
+  return server.server.connections.begin()->first;
+}
+
+// `count` messages of `size` bytes back to back, as plain packets or packed `per_batch` to a batch packet
+auto make_stream(size_t count, size_t size, size_t per_batch) -> std::vector<char> {
+  const auto message = std::string(size, 'x');
+  const auto packet = winnet::make_packet(winnet::PacketType::data, std::array{std::span<const char>{message}});
+
+  auto stream = std::vector<char>{};
+  for (auto sent = size_t{0}; sent < count; sent += per_batch) {
+    const auto packed = std::min(per_batch, count - sent);
+    if (per_batch == 1) {
+      stream.insert(stream.end(), packet.begin(), packet.end());
+      continue;
+    }
+    auto packets = std::vector<char>{};
+    for (auto i = size_t{0}; i < packed; ++i) {
+      packets.insert(packets.end(), packet.begin(), packet.end());
+    }
+    const auto batch = winnet::make_packet(winnet::PacketType::batch, std::array{std::span<const char>{packets}});
+    stream.insert(stream.end(), batch.begin(), batch.end());
+  }
+  return stream;
+}
+
+// one connection receiving a stream that is already waiting, framing and dispatch only
+auto bench_recv(std::string_view name, size_t count, size_t size, size_t per_batch) -> bool {
+  auto loop = winnet::LoopbackTransport{};
+  auto server = BenchServer{loop};
+  auto received = size_t{0};
+  server.server.cb.on_recv_success = [&](winnet::Server *, winnet::Connection &) { ++received; };
+  const auto sock = accept_peer(loop, server);
+  if (sock == INVALID_SOCKET) {
+    return false;
+  }
+
+  const auto stream = make_stream(count, size, per_batch);
+  const auto start = std::chrono::steady_clock::now();
+  loop.inject(sock, stream);
+  if (!run_until({&server.handler}, [&]() { return received == count; })) {
+    return false;
+  }
+  report(name, count, count * size, std::chrono::steady_clock::now() - start);
+  return true;
+}
+
+auto bench_recv_small() -> bool {
+  return bench_recv("recv 32 B", 200'000, 32, 1);
+}
+
+auto bench_recv_large() -> bool {
+  return bench_recv("recv 4 KiB", 20'000, 4096, 1);
+}
+
+auto bench_recv_batched() -> bool {
+  return bench_recv("recv 32 B, batches of 64", 200'000, 32, 64);
+}
+
+// every message from one peer is sent to BROADCAST_CLIENTS clients, which frame and dispatch it again
+auto bench_broadcast(std::string_view name, size_t count, bool use_batching) -> bool {
+  auto loop = winnet::LoopbackTransport{};
+  auto server = BenchServer{loop};
+  if (use_batching) {
+    server.handler.enable_batching(std::chrono::microseconds{0});
+  }
+  server.server.cb.on_recv_success = [](winnet::Server *server, winnet::Connection &conn) {
+    server->send_all(conn.get_recv_string());
+  };
+  const auto sock = accept_peer(loop, server);
+  if (sock == INVALID_SOCKET) {
+    return false;
+  }
+
+  auto received = size_t{0};
+  auto clients = std::vector<std::unique_ptr<winnet::Client>>{};
+  auto client_handlers = std::vector<std::unique_ptr<winnet::ConnectionHandler>>{};
+  auto handlers = std::vector<winnet::ConnectionHandler *>{&server.handler};
+  for (auto i = size_t{0}; i < BROADCAST_CLIENTS; ++i) {
+    auto &client = clients.emplace_back(std::make_unique<winnet::Client>());
+    client->transport = &loop;
+    client->cb.on_recv_success = [&](winnet::Client *, winnet::Connection &) { ++received; };
+    auto &client_handler = client_handlers.emplace_back(std::make_unique<winnet::ConnectionHandler>(client.get()));
+    if (!client->connect(*client_handler, "127.0.0.1", std::to_string(BENCH_PORT))) {
+      return false;
+    }
+    handlers.push_back(client_handler.get());
+  }
+  if (!run_until(handlers, [&]() { return server.server.connections.size() == BROADCAST_CLIENTS + 1; })) {
+    return false;
+  }
+
+  constexpr auto size = size_t{32};
+  const auto stream = make_stream(count, size, 1);
+  const auto start = std::chrono::steady_clock::now();
+  loop.inject(sock, stream);
+  if (!run_until(handlers, [&]() { return received == count * BROADCAST_CLIENTS; })) {
+    return false;
+  }
+  report(name, received, received * size, std::chrono::steady_clock::now() - start);
+  return true;
+}
+
+auto bench_broadcast_plain() -> bool {
+  return bench_broadcast("broadcast 32 B", 5'000, false);
+}
+
+auto bench_broadcast_batched() -> bool {
+  return bench_broadcast("broadcast 32 B, batching", 5'000, true);
+}
+
+struct BenchCase {
+  std::string_view name;
+  bool (*run)();
+};
+
+const auto BENCH_CASES = std::array{
+  BenchCase{"recv_small", bench_recv_small},
+  BenchCase{"recv_large", bench_recv_large},
+  BenchCase{"recv_batched", bench_recv_batched},
+  BenchCase{"broadcast", bench_broadcast_plain},
+  BenchCase{"broadcast_batched", bench_broadcast_batched},
+};
+
+} // namespace
+
+auto main(int argc, char *argv[]) -> int {
+  const auto only = argc > 1 ? std::string_view{argv[1]} : std::string_view{};
+  auto ran = 0;
+  auto is_ok = true;
+  for (const auto &bench_case : BENCH_CASES) {
+    if (!only.empty() && bench_case.name != only) {
+      continue;
+    }
+
+    if (!bench_case.run()) {
+      std::cerr << std::format("{} did not finish\n", bench_case.name);
+      is_ok = false;
+    }
+    ++ran;
+  }
+  utils::log_flush();
+
+  if (ran == 0) {
+    std::cerr << std::format("unknown bench case: {}\n", only);
+    return EXIT_FAILURE;
+  }
+  return is_ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
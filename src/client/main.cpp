@@ -1,8 +1,11 @@
 #define WIN32_LEAN_AND_MEAN
 
+#include <mutex>
 #include <chrono>
 #include <future>
 #include <format>
+#include <vector>
+#include <algorithm>
 
 #include <ftxui/component/captured_mouse.hpp>
 #include <ftxui/component/component.hpp>
@@ -15,6 +18,8 @@
 
 #define SERVER_IP "localhost"
 #define SERVER_PORT "8000"
+// older messages are dropped from the view
+#define MESSAGE_HISTORY_SIZE 1000
 
 auto main() -> int {
   if (!winnet::wsa_init()) {
@@ -28,47 +33,103 @@ auto main() -> int {
   auto stop_flag = std::atomic_bool{false};
   auto conn_handler = winnet::ConnectionHandler{client};
   conn_handler.init();
+  client->enable_sessions();
 
   auto screen = ftxui::ScreenInteractive::FullscreenAlternateScreen();
-  auto message_list = std::vector<std::string>{};
-  auto selected_msg = 0;
+  auto message_list = utils::RingBuffer<std::string>{MESSAGE_HISTORY_SIZE};
+  auto scroll_offset = size_t{0}; // rows scrolled up from the newest message
+
+  // messages from the network thread are collected here and moved to the ui in one batch per redraw
+  auto pending_mutex = std::mutex{};
+  auto pending_messages = std::vector<std::string>{};
+
+  const auto post_message = [&](std::string message) {
+    const auto lock = std::scoped_lock{pending_mutex};
+    pending_messages.push_back(std::move(message));
+    if (pending_messages.size() > 1) {
+      // a redraw is already scheduled
+      return;
+    }
+
+    screen.Post([&]() {
+      auto messages = std::vector<std::string>{};
+      {
+        const auto lock = std::scoped_lock{pending_mutex};
+        messages.swap(pending_messages);
+      }
+      for (auto &message : messages) {
+        message_list.push_back(std::move(message));
+      }
+      if (scroll_offset > 0) {
+        // keep the rows the user is reading in place
+        scroll_offset = std::min(scroll_offset + messages.size(), message_list.size() - 1);
+      }
+      screen.PostEvent(ftxui::Event::Custom);
+    });
+  };
+
+  const auto visible_rows = [&]() {
+    // everything but the border, title, separators and input line
+    return static_cast<size_t>(std::max(screen.dimy() - 6, 1));
+  };
 
-  auto messages = ftxui::Menu({
-    .entries = &message_list,
-    .selected = &selected_msg,
+  // only the rows that fit on screen are turned into elements
+  auto messages = ftxui::Renderer([&] {
+    const auto rows = std::min(visible_rows(), message_list.size());
+    const auto end = message_list.size() - std::min(scroll_offset, message_list.size() - rows);
+    auto elements = ftxui::Elements{};
+    elements.reserve(rows);
+    for (auto i = end - rows; i < end; ++i) {
+      elements.push_back(ftxui::text(message_list[i]));
+    }
+    return ftxui::vbox(std::move(elements));
   });
 
+  const auto scroll_messages = [&](ftxui::Event event) {
+    const auto max_offset = message_list.size() - std::min(visible_rows(), message_list.size());
+    if (event == ftxui::Event::PageUp) {
+      scroll_offset = std::min(scroll_offset + visible_rows(), max_offset);
+      return true;
+    }
+    if (event == ftxui::Event::PageDown) {
+      scroll_offset -= std::min(scroll_offset, visible_rows());
+      return true;
+    }
+    if (event.is_mouse() && event.mouse().button == ftxui::Mouse::WheelUp) {
+      scroll_offset = std::min(scroll_offset + 1, max_offset);
+      return true;
+    }
+    if (event.is_mouse() && event.mouse().button == ftxui::Mouse::WheelDown) {
+      scroll_offset -= std::min(scroll_offset, size_t{1});
+      return true;
+    }
+    return false;
+  };
+
   auto text_input = std::string{};
   auto input_option = ftxui::InputOption{};
   input_option.multiline = false;
   input_option.on_enter = [&]() {
-    client->connection->send(text_input);
+    // the tick thread replaces the connection on every reconnect, so it is only touched from there
+    conn_handler.post([client, message = std::move(text_input)]() {
+      if (client->connection != nullptr) {
+        client->connection->send(message);
+      }
+    });
     text_input = "";
   };
   auto textarea = ftxui::Input(&text_input, input_option);
 
   client->cb.on_conn_started = [&](winnet::Client *, winnet::Connection &) {
-    screen.Post([&]() {
-      message_list.emplace_back(std::format("서버에 접속되었습니다. ({}:{})\n", SERVER_IP, SERVER_PORT));
-      selected_msg = static_cast<int>(message_list.size() - 1);
-      screen.PostEvent(ftxui::Event::Custom);
-    });
+    post_message(std::format("서버에 접속되었습니다. ({}:{})\n", SERVER_IP, SERVER_PORT));
   };
 
   client->cb.on_conn_ended = [&](winnet::Client *, winnet::Connection &) {
-    screen.Post([&]() {
-      message_list.emplace_back("서버와 접속이 끊겼습니다.");
-      selected_msg = static_cast<int>(message_list.size() - 1);
-      screen.PostEvent(ftxui::Event::Custom);
-    });
+    post_message("서버와 접속이 끊겼습니다.");
   };
 
   client->cb.on_recv_success = [&](winnet::Client *, winnet::Connection &conn) {
-    screen.Post([&, recv_string = conn.get_recv_string()]() {
-      message_list.push_back(recv_string);
-      selected_msg = static_cast<int>(message_list.size() - 1);
-      screen.PostEvent(ftxui::Event::Custom);
-    });
+    post_message(conn.get_recv_string());
   };
 
   client->cb.on_recv_error = [](winnet::Client *, winnet::Connection &, int err_code) {
@@ -79,22 +140,24 @@ auto main() -> int {
     // wait for fixui screen loop to start
     std::this_thread::sleep_for(std::chrono::milliseconds(500));
 
-    while (!client->connect(conn_handler, SERVER_IP, SERVER_PORT)) {
-      screen.Post([&]() {
-        message_list.emplace_back("서버에 접속중...");
-        selected_msg = static_cast<int>(message_list.size() - 1);
-        screen.PostEvent(ftxui::Event::Custom);
-      });
-      std::this_thread::sleep_for(std::chrono::milliseconds(500));
-    }
-
     const auto timeout = timeval{
       .tv_sec = 1,
       .tv_usec = 0,
     };
 
-    if (!conn_handler.run(timeout, stop_flag)) {
-      stop_flag.store(true);
+    while (!stop_flag.load()) {
+      // reconnect and resume the session whenever the connection drops
+      if (!client->connect(conn_handler, SERVER_IP, SERVER_PORT)) {
+        post_message("서버에 접속중...");
+        std::this_thread::sleep_for(std::chrono::milliseconds(500));
+        continue;
+      }
+
+      while (!stop_flag.load() && client->connection != nullptr) {
+        if (!conn_handler.tick(timeout)) {
+          client->disconnect(conn_handler);
+        }
+      }
     }
   });
 
@@ -105,16 +168,19 @@ auto main() -> int {
 
   textarea->TakeFocus();
 
-  screen.Loop(ftxui::Renderer(container, [&] {
+  auto root = ftxui::Renderer(container, [&] {
     return ftxui::vbox({
              ftxui::text("채팅 서버") | ftxui::center,
              ftxui::separator(),
-             messages->Render() | ftxui::focusPositionRelative(0, 1) | ftxui::yframe | ftxui::flex,
+             messages->Render() | ftxui::flex,
              ftxui::separator(),
              textarea->Render(),
            }) |
            ftxui::border;
-  }));
+  });
+
+  // the textarea always has the focus, so scrolling is caught at the root before events reach it
+  screen.Loop(ftxui::CatchEvent(root, scroll_messages));
 
   stop_flag.store(true);
   fut_tick.wait();
@@ -0,0 +1,152 @@
+#define WIN32_LEAN_AND_MEAN
+
+#include <array>
+#include <chrono>
+#include <format>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+#include <iostream>
+#include <unordered_map>
+
+#include <utils.hpp>
+#include <winnet.hpp>
+
+// feeds the packets clients sent in a capture back into a server
+// replay <capture file> [--fast] [--ip <ip>] [--port <port>]
+
+struct ReplayPeer {
+  std::unique_ptr<winnet::Client> client;
+  std::unique_ptr<winnet::ConnectionHandler> conn_handler;
+  bool is_connected;
+};
+
+struct ReplayStats {
+  uint64_t packets_sent;
+  uint64_t bytes_sent;
+  uint64_t packets_recv;
+  uint64_t bytes_recv;
+};
+
+auto main(int argc, char *argv[]) -> int {
+  auto capture_path = std::string{};
+  auto ip = std::string{"localhost"};
+  auto port = std::string{"8000"};
+  auto is_fast = false;
+  for (auto i = 1; i < argc; ++i) {
+    const auto arg = std::string{argv[i]};
+    if (arg == "--fast") {
+      is_fast = true;
+    } else if (arg == "--ip" && i + 1 < argc) {
+      ip = argv[++i];
+    } else if (arg == "--port" && i + 1 < argc) {
+      port = argv[++i];
+    } else if (capture_path.empty()) {
+      capture_path = arg;
+    } else {
+      std::cerr << std::format("unknown argument: {}\n", arg);
+      return EXIT_FAILURE;
+    }
+  }
+  if (capture_path.empty()) {
+    std::cerr << "usage: replay <capture file> [--fast] [--ip <ip>] [--port <port>]\n";
+    return EXIT_FAILURE;
+  }
+
+  auto reader = winnet::CaptureReader{};
+  if (!reader.open(capture_path)) {
+    return EXIT_FAILURE;
+  }
+
+  if (!winnet::wsa_init()) {
+    return EXIT_FAILURE;
+  }
+  defer(winnet::wsa_deinit);
+
+  auto peers = std::unordered_map<uint64_t, ReplayPeer>{};
+  auto stats = ReplayStats{};
+  const auto no_wait = timeval{
+    .tv_sec = 0,
+    .tv_usec = 0,
+  };
+
+  const auto tick_all = [&]() {
+    for (auto &[conn_id, peer] : peers) {
+      if (peer.is_connected && peer.client->connection != nullptr) {
+        peer.conn_handler->tick(no_wait);
+      }
+    }
+  };
+
+  const auto get_peer = [&](uint64_t conn_id) -> ReplayPeer & {
+    if (auto it = peers.find(conn_id); it != peers.end()) {
+      return it->second;
+    }
+
+    auto peer = ReplayPeer{
+      .client = std::make_unique<winnet::Client>(),
+      .conn_handler = nullptr,
+      .is_connected = false,
+    };
+    peer.conn_handler = std::make_unique<winnet::ConnectionHandler>(peer.client.get());
+    peer.conn_handler->init();
+    peer.client->cb.on_recv_success = [&](winnet::Client *, winnet::Connection &conn) {
+      stats.packets_recv += 1;
+      stats.bytes_recv += conn.get_recv_bytes().size();
+    };
+    peer.is_connected = peer.client->connect(*peer.conn_handler, ip, port);
+    if (!peer.is_connected) {
+      std::cerr << std::format("connection {} could not connect to {}:{}\n", conn_id, ip, port);
+    }
+    return peers.insert({conn_id, std::move(peer)}).first->second;
+  };
+
+  std::cout << std::format("replaying {} to {}:{} ({})\n", capture_path, ip, port, is_fast ? "fast" : "original speed");
+  const auto start_time = std::chrono::steady_clock::now();
+
+  auto record = winnet::CaptureRecord{};
+  auto payload = std::span<const char>{};
+  while (reader.next(record, payload)) {
+    // only what the clients sent is replayed, the server produces the rest
+    if (record.direction != winnet::CaptureDirection::recv) {
+      continue;
+    }
+
+    if (!is_fast) {
+      const auto due_time = start_time + std::chrono::nanoseconds{record.timestamp_ns};
+      while (std::chrono::steady_clock::now() < due_time) {
+        tick_all();
+        std::this_thread::yield();
+      }
+    }
+
+    auto &peer = get_peer(record.conn_id);
+    if (!peer.is_connected || peer.client->connection == nullptr) {
+      continue;
+    }
+
+    peer.client->connection->send_packet(static_cast<winnet::PacketType>(record.packet_type), std::array{payload});
+    stats.packets_sent += 1;
+    stats.bytes_sent += payload.size();
+    tick_all();
+  }
+
+  // let the send queues drain and collect the last replies
+  const auto drain_end = std::chrono::steady_clock::now() + std::chrono::seconds{1};
+  while (std::chrono::steady_clock::now() < drain_end) {
+    tick_all();
+  }
+
+  const auto elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start_time).count();
+  std::cout << std::format("connections: {}\n", peers.size());
+  std::cout << std::format("sent: {} packets, {} bytes\n", stats.packets_sent, stats.bytes_sent);
+  std::cout << std::format("recv: {} packets, {} bytes\n", stats.packets_recv, stats.bytes_recv);
+  std::cout << std::format("elapsed: {:.3f}s ({:.0f} packets/s sent)\n", elapsed, stats.packets_sent / elapsed);
+
+  for (auto &[conn_id, peer] : peers) {
+    peer.client->disconnect(*peer.conn_handler);
+  }
+
+  return EXIT_SUCCESS;
+}
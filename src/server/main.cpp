@@ -1,13 +1,93 @@
 #define WIN32_LEAN_AND_MEAN
 
 #include <array>
+#include <algorithm>
+#include <chrono>
+#include <charconv>
 #include <format>
+#include <string>
+#include <string_view>
+#include <vector>
 #include <iostream>
 
 #include <utils.hpp>
+#include <logger.hpp>
 #include <winnet.hpp>
 
-auto main() -> int {
+// bytes of recent chat kept for clients that join later
+#define HISTORY_CAPACITY (64 * 1024)
+// unacked bytes kept per session and how long a dropped client can take to come back
+#define SESSION_RETRANSMIT_CAPACITY (256 * 1024)
+#define SESSION_EXPIRY_SEC 60
+// how often buffer pool usage is logged
+#define POOL_REPORT_INTERVAL_SEC 60
+// broadcasts queued to a client within this window go out as one packet, 0 packs per tick
+#define BATCH_WINDOW_USEC 0
+
+namespace {
+
+constexpr auto USAGE = "usage: server [--port <port>] [--link <host:port>]... [--link-secret <secret>]\n"
+                       "              [--capture <file>] [--takeover <path>] [--handoff <path> [--handoff-drain]]\n";
+
+// all of `text` has to be a port number, 0 is not one
+auto parse_port(std::string_view text, uint16_t &port) -> bool {
+  auto value = uint16_t{0};
+  const auto [end, err] = std::from_chars(text.data(), text.data() + text.size(), value);
+  if (err != std::errc{} || end != text.data() + text.size() || value == 0) {
+    return false;
+  }
+
+  port = value;
+  return true;
+}
+
+} // namespace
+
+auto main(int argc, char *argv[]) -> int {
+  // --link: relay broadcasts with the server at <host:port>, every user on linked servers shares one room
+  // --link-secret: shared by the linked servers, links from servers without it are refused
+  // --takeover: take the listen socket and connections over from the server waiting on <path>
+  // --handoff: wait on <path> for the next version, --handoff-drain only passes the listen socket
+  //            and keeps serving the current connections until they leave
+  auto port = uint16_t{8000};
+  auto links = std::vector<std::string>{};
+  auto link_secret = std::string{};
+  auto capture_path = std::string{};
+  auto takeover_path = std::string{};
+  auto handoff_path = std::string{};
+  auto handoff_drain = false;
+  for (auto i = 1; i < argc; ++i) {
+    const auto arg = std::string{argv[i]};
+    if (arg == "--port" && i + 1 < argc) {
+      if (!parse_port(argv[++i], port)) {
+        std::cerr << std::format("invalid port: {}\n{}", argv[i], USAGE);
+        return EXIT_FAILURE;
+      }
+    } else if (arg == "--link" && i + 1 < argc) {
+      const auto link = std::string_view{argv[++i]};
+      const auto colon = link.rfind(':');
+      auto link_port = uint16_t{0};
+      if (colon == std::string_view::npos || colon == 0 || !parse_port(link.substr(colon + 1), link_port)) {
+        std::cerr << std::format("invalid link, expected host:port: {}\n{}", link, USAGE);
+        return EXIT_FAILURE;
+      }
+      links.emplace_back(link);
+    } else if (arg == "--link-secret" && i + 1 < argc) {
+      link_secret = argv[++i];
+    } else if (arg == "--capture" && i + 1 < argc) {
+      capture_path = argv[++i];
+    } else if (arg == "--takeover" && i + 1 < argc) {
+      takeover_path = argv[++i];
+    } else if (arg == "--handoff" && i + 1 < argc) {
+      handoff_path = argv[++i];
+    } else if (arg == "--handoff-drain") {
+      handoff_drain = true;
+    } else {
+      std::cerr << std::format("unknown argument: {}\n{}", arg, USAGE);
+      return EXIT_FAILURE;
+    }
+  }
+
   if (!winnet::wsa_init()) {
     return EXIT_FAILURE;
   }
@@ -16,45 +96,133 @@ auto main() -> int {
   auto server = new winnet::Server{};
   defer([=] { delete (server); });
 
-  if (!server->init(8000)) {
-    return EXIT_FAILURE;
+  auto conn_handler = winnet::ConnectionHandler{server};
+
+  if (!takeover_path.empty()) {
+    if (!winnet::Handoff::receive(takeover_path, server, conn_handler)) {
+      return EXIT_FAILURE;
+    }
+    std::cout << std::format("took over {} connections\n", server->connections.size());
+  } else {
+    if (!server->init(port)) {
+      return EXIT_FAILURE;
+    }
+
+    if (!server->listen()) {
+      return EXIT_FAILURE;
+    }
   }
 
-  if (!server->listen()) {
-    return EXIT_FAILURE;
+  server->enable_sessions(SESSION_RETRANSMIT_CAPACITY, std::chrono::seconds{SESSION_EXPIRY_SEC});
+  server->link_secret = link_secret;
+  for (const auto &link : links) {
+    server->add_link(link);
   }
 
-  auto stop_flag = false;
-  auto conn_handler = winnet::ConnectionHandler{server};
+  auto history = winnet::MessageHistory{HISTORY_CAPACITY};
+
+  auto is_draining = false;
   conn_handler.init();
 
+  auto handoff = winnet::Handoff{};
+  if (!handoff_path.empty()) {
+    const auto on_request = [&]() {
+      conn_handler.post([&]() {
+        if (!handoff.send(server, conn_handler, !handoff_drain)) {
+          utils::log_error("handoff failed, still serving\n");
+          return;
+        }
+        utils::log_info("handed over to the new process\n");
+        is_draining = true;
+      });
+    };
+    if (!handoff.listen(handoff_path, on_request)) {
+      return EXIT_FAILURE;
+    }
+  }
+
+  // keep one spamming client from starving everyone else
+  conn_handler.rate_limit = winnet::RateLimitPolicy{
+    .msgs_per_sec = 20,
+    .msgs_burst = 40,
+    .bytes_per_sec = 64 * 1024,
+    .bytes_burst = 256 * 1024,
+    .recv_budget = 64 * 1024,
+    .action = winnet::RateLimitAction::delay,
+  };
+
+  conn_handler.enable_batching(std::chrono::microseconds{BATCH_WINDOW_USEC});
+
+  if (!capture_path.empty()) {
+    if (!conn_handler.enable_capture(capture_path)) {
+      return EXIT_FAILURE;
+    }
+    std::cout << std::format("capturing traffic to {}\n", capture_path);
+  }
+
+  auto last_pool_report = std::chrono::steady_clock::now();
+  const auto report_pool = [&]() {
+    const auto now = std::chrono::steady_clock::now();
+    if (now - last_pool_report < std::chrono::seconds{POOL_REPORT_INTERVAL_SEC}) {
+      return;
+    }
+    last_pool_report = now;
+
+    const auto stats = server->buffer_pool.stats();
+    const auto total = stats.hits + stats.misses;
+    const auto hit_rate = total == 0 ? 0.0 : 100.0 * static_cast<double>(stats.hits) / static_cast<double>(total);
+    utils::log_info("buffer pool: {} hits, {} misses ({:.1f}% hit rate), {} KiB resident\n", stats.hits, stats.misses,
+                    hit_rate, stats.resident_bytes / 1024);
+  };
+
   server->cb.on_conn_started = [](winnet::Server *, winnet::Connection &conn) {
-    std::cout << std::format("client connected: {:X}\n", conn.socket);
-    conn.send("[서버] 당신의 이름을 입력해주세요.");
+    utils::log_info("client connected: {:X}\n", conn.socket);
+    conn.send("[서버] 당신의 이름을 입력해주세요.", winnet::SendLane::high);
+  };
+
+  server->cb.on_conn_ended = [&](winnet::Server *server, winnet::Connection &conn) {
+    const auto lanes = conn.send_lane_stats();
+    utils::log_info("client disconnected: {:X} (peak send queue depth: control {}, high {}, normal {}, bulk {})\n",
+                    conn.socket, lanes[0].peak_depth, lanes[1].peak_depth, lanes[2].peak_depth, lanes[3].peak_depth);
+    const auto message = std::format("[서버] {}님의 접속이 끊겼습니다.", conn.username);
+    history.push_back(message);
+    server->publish(message);
   };
 
-  server->cb.on_conn_ended = [](winnet::Server *server, winnet::Connection &conn) {
-    std::cout << std::format("client disconnected: {:X}\n", conn.socket);
-    server->send_all(std::format("[서버] {}님의 접속이 끊겼습니다.", conn.username));
+  server->cb.on_conn_throttled = [](winnet::Server *, winnet::Connection &conn) {
+    utils::log_info("client throttled: {:X} {} (recv: {} packets, {} bytes, throttled {} times)\n", conn.socket,
+                    conn.username, conn.stats.recv_packets, conn.stats.recv_bytes, conn.stats.throttle_count);
   };
 
-  server->cb.on_recv_success = [](winnet::Server *server, winnet::Connection &conn) {
+  server->cb.on_recv_success = [&](winnet::Server *server, winnet::Connection &conn) {
     const auto recv_string = conn.get_recv_string();
-    std::cout << std::format("recv: {}\n", recv_string);
+    utils::log_info("recv: {}\n", recv_string);
 
     if (conn.username.empty()) {
       conn.username = recv_string;
-      conn.send(std::format("[서버] 당신의 이름은 {} 입니다.", recv_string));
+      conn.send(std::format("[서버] 당신의 이름은 {} 입니다.", recv_string), winnet::SendLane::high);
 
+      // catch up on recent messages with a single send, on the lane of live chat so newer messages stay behind it
+      conn.send_framed(history.snapshot());
+
+      const auto message = std::format("[서버] {}님이 접속했습니다.", conn.username);
+      history.push_back(message);
       auto ignore_socket = std::array{conn.socket};
-      server->send_all_but(ignore_socket, std::format("[서버] {}님이 접속했습니다.", conn.username));
+      server->publish_but(ignore_socket, message);
     } else {
-      server->send_all(std::format("{}: {}", conn.username, recv_string));
+      const auto message = std::format("{}: {}", conn.username, recv_string);
+      history.push_back(message);
+      server->publish(message);
     }
   };
 
+  server->cb.on_relay = [&](winnet::Server *, std::span<const char> data) {
+    // already sent to our users, keep it for the ones joining later
+    history.push_back(data);
+  };
+
   server->cb.on_recv_error = [](winnet::Server *, winnet::Connection &conn, int err_code) {
-    std::cerr << std::format("recv error: {:X} (error code: {})\n", conn.socket, err_code);
+    utils::log_error("recv error: {:X} (error code: {})\n", conn.socket, err_code);
   };
 
   const auto timeout = timeval{
@@ -63,8 +231,16 @@ auto main() -> int {
   };
 
   std::cout << "server started\n";
-  if (!conn_handler.run(timeout, stop_flag)) {
-    return EXIT_FAILURE;
+  // after a handoff only the users that were not passed on are served
+  const auto has_users = [&]() {
+    return std::ranges::any_of(server->connections, [](const auto &entry) { return !entry.second.is_link; });
+  };
+  while (!is_draining || has_users()) {
+    if (!conn_handler.tick(timeout)) {
+      return EXIT_FAILURE;
+    }
+    // select hardly ever times out with clients connected, their sockets are always writable
+    report_pool();
   }
 
   return EXIT_SUCCESS;
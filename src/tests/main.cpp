@@ -0,0 +1,391 @@
+#define WIN32_LEAN_AND_MEAN
+
+#include <array>
+#include <random>
+#include <format>
+#include <string>
+#include <vector>
+#include <cstring>
+#include <iostream>
+#include <functional>
+#include <initializer_list>
+#include <string_view>
+
+#include <logger.hpp>
+#include <winnet.hpp>
+#include <loopback.hpp>
+
+// tests of the framing in ConnectionHandler::tick, driven over a LoopbackTransport
+// tests [<case>], without a case every case runs, ctest runs each one on its own (see CMakeLists.txt)
+
+namespace {
+
+auto failure_count = 0;
+
+auto check(bool is_ok, std::string_view expr, int line) -> bool {
+  if (!is_ok) {
+    std::cerr << std::format("line {}: check failed: {}\n", line, expr);
+    ++failure_count;
+  }
+  return is_ok;
+}
+
+#define CHECK(expr) check((expr), #expr, __LINE__)
+
+inline constexpr uint16_t TEST_PORT = 8000;
+// enough for every case, a stuck case fails instead of spinning forever
+inline constexpr int MAX_TICKS = 10'000;
+
+const auto NO_WAIT = timeval{
+  .tv_sec = 0,
+  .tv_usec = 0,
+};
+
+auto make_data(std::string_view message) -> std::vector<char> {
+  return winnet::make_packet(winnet::PacketType::data, std::array{std::span<const char>{message}});
+}
+
+auto append(std::vector<char> &out, std::span<const char> bytes) -> void {
+  out.insert(out.end(), bytes.begin(), bytes.end());
+}
+
+// a server without sessions that keeps every message it receives
+struct TestServer {
+  winnet::Server server;
+  winnet::ConnectionHandler handler;
+  std::vector<std::string> received;
+
+  explicit TestServer(winnet::LoopbackTransport &loop) : server{}, handler{&server}, received{} {
+    server.transport = &loop;
+    CHECK(server.init(TEST_PORT) && server.listen());
+    handler.init();
+    server.cb.on_recv_success = [this](winnet::Server *, winnet::Connection &conn) {
+      received.push_back(conn.get_recv_string());
+    };
+  }
+};
+
+// tick every handler until `is_done`, false when a tick fails or it takes too long
+auto run_until(std::initializer_list<winnet::ConnectionHandler *> handlers, const std::function<bool()> &is_done)
+  -> bool {
+  for (auto i = 0; i < MAX_TICKS; ++i) {
+    if (is_done()) {
+      return true;
+    }
+    for (auto handler : handlers) {
+      if (!handler->tick(NO_WAIT)) {
+        return false;
+      }
+    }
+  }
+  return is_done();
+}
+
+struct RawPeer {
+  SOCKET socket;   // written by the test
+  SOCKET accepted; // the server side of the connection
+};
+
+// a peer that writes bytes as they are given, the server has accepted it on return
+auto connect_raw(winnet::LoopbackTransport &loop, TestServer &server) -> RawPeer {
+  auto addr = SOCKADDR_IN{};
+  const auto sock = loop.connect("127.0.0.1", std::to_string(TEST_PORT), addr);
+  CHECK(sock != INVALID_SOCKET);
+  CHECK(run_until({&server.handler}, [&]() { return server.server.connections.size() == 1; }));
+  return RawPeer{
+    .socket = sock,
+    .accepted = server.server.connections.empty() ? INVALID_SOCKET : server.server.connections.begin()->first,
+  };
+}
+
+auto send_raw(winnet::LoopbackTransport &loop, SOCKET sock, std::span<const char> bytes) -> void {
+  auto sent = u_long{0};
+  CHECK(loop.send(sock, bytes.data(), static_cast<u_long>(bytes.size()), sent) == 0 && sent == bytes.size());
+}
+
+auto test_split_header() -> void {
+  // every way to cut the 5 byte header in two, with a read that finds nothing in between
+  for (auto cut = u_long{1}; cut < sizeof(winnet::PacketHeader); ++cut) {
+    auto loop = winnet::LoopbackTransport{};
+    auto server = TestServer{loop};
+    const auto peer = connect_raw(loop, server);
+
+    loop.script_recv(peer.accepted, {cut, 0, static_cast<u_long>(sizeof(winnet::PacketHeader)) - cut, 2, 0, 3});
+    send_raw(loop, peer.socket, make_data("hello"));
+    CHECK(run_until({&server.handler}, [&]() { return !server.received.empty(); }));
+    CHECK(server.received == std::vector<std::string>{"hello"});
+    // a read that would block does not end the connection
+    CHECK(server.server.connections.contains(peer.accepted));
+  }
+}
+
+auto test_short_reads_and_writes() -> void {
+  auto loop = winnet::LoopbackTransport{};
+  auto server = TestServer{loop};
+  server.server.cb.on_recv_success = [&](winnet::Server *, winnet::Connection &conn) {
+    server.received.push_back(conn.get_recv_string());
+    conn.send(conn.get_recv_string());
+  };
+
+  auto client = winnet::Client{};
+  client.transport = &loop;
+  auto client_handler = winnet::ConnectionHandler{&client};
+  auto echoed = std::vector<std::string>{};
+  client.cb.on_recv_success = [&](winnet::Client *, winnet::Connection &conn) {
+    echoed.push_back(conn.get_recv_string());
+  };
+  CHECK(client.connect(client_handler, "127.0.0.1", std::to_string(TEST_PORT)));
+  CHECK(run_until({&server.handler}, [&]() { return server.server.connections.size() == 1; }));
+  const auto accepted = server.server.connections.begin()->first;
+  const auto client_socket = client.connection->socket;
+
+  // both directions move a few bytes per call, across header and body boundaries
+  loop.script_send(client_socket, {1, 2, 3, 1, 7, 1, 4, 9});
+  loop.script_recv(accepted, {3, 1, 4, 1, 5, 9, 2, 6});
+  loop.script_send(accepted, {2, 7, 1, 8, 2, 8});
+  loop.script_recv(client_socket, {1, 1, 2, 3, 5, 8, 13});
+
+  const auto messages = std::vector<std::string>{"one", "two", "three", std::string(300, 'x')};
+  for (const auto &message : messages) {
+    client.connection->send(message);
+  }
+  CHECK(run_until({&server.handler, &client_handler}, [&]() { return echoed.size() == messages.size(); }));
+  CHECK(server.received == messages);
+  CHECK(echoed == messages);
+}
+
+auto test_zero_length_body() -> void {
+  auto loop = winnet::LoopbackTransport{};
+  auto server = TestServer{loop};
+  const auto peer = connect_raw(loop, server);
+
+  // an empty message between two others, then a packet type that ignores a missing body
+  auto stream = std::vector<char>{};
+  append(stream, make_data("before"));
+  append(stream, make_data(""));
+  append(stream, winnet::make_packet(winnet::PacketType::capabilities, {}));
+  append(stream, make_data("after"));
+  send_raw(loop, peer.socket, stream);
+
+  CHECK(run_until({&server.handler}, [&]() { return server.received.size() == 3; }));
+  CHECK((server.received == std::vector<std::string>{"before", "", "after"}));
+  CHECK(server.server.connections.contains(peer.accepted));
+}
+
+auto test_batch_unpacking() -> void {
+  auto loop = winnet::LoopbackTransport{};
+  auto server = TestServer{loop};
+  const auto peer = connect_raw(loop, server);
+
+  auto inner = std::vector<char>{};
+  append(inner, make_data("a"));
+  append(inner, make_data(""));
+  append(inner, make_data("bb"));
+  auto stream = winnet::make_packet(winnet::PacketType::batch, std::array{std::span<const char>{inner}});
+
+  // a nested batch and a cut off packet are skipped without losing the rest of the stream
+  auto bad_inner = winnet::make_packet(winnet::PacketType::batch, std::array{std::span<const char>{inner}});
+  const auto cut_off = make_data("lost");
+  bad_inner.insert(bad_inner.end(), cut_off.begin(), cut_off.end() - 1);
+  append(stream, winnet::make_packet(winnet::PacketType::batch, std::array{std::span<const char>{bad_inner}}));
+  append(stream, make_data("after"));
+
+  loop.script_recv(peer.accepted, {7, 1, 0, 3});
+  send_raw(loop, peer.socket, stream);
+  CHECK(run_until({&server.handler}, [&]() { return server.received.size() == 4; }));
+  CHECK((server.received == std::vector<std::string>{"a", "", "bb", "after"}));
+}
+
+auto test_oversized_header() -> void {
+  auto loop = winnet::LoopbackTransport{};
+  auto server = TestServer{loop};
+  auto error_code = 0;
+  server.server.cb.on_recv_error = [&](winnet::Server *, winnet::Connection &, int err_code) { error_code = err_code; };
+  const auto peer = connect_raw(loop, server);
+
+  const auto header = winnet::PacketHeader{
+    .packet_size = static_cast<uint32_t>(winnet::ConnectionHandler::MAX_PACKET_SIZE + 1),
+    .packet_type = winnet::PacketType::data,
+  };
+  send_raw(loop, peer.socket, std::span{std::bit_cast<const char *>(&header), sizeof(header)});
+  CHECK(run_until({&server.handler}, [&]() { return server.server.connections.empty(); }));
+  CHECK(error_code == WSAEMSGSIZE);
+}
+
+auto test_oversized_message() -> void {
+  auto loop = winnet::LoopbackTransport{};
+  auto server = TestServer{loop};
+  const auto peer = connect_raw(loop, server);
+
+  // fits MAX_PACKET_SIZE, but not once it is wrapped in a relay, so it is dropped without ending the connection
+  send_raw(loop, peer.socket, make_data(std::string(winnet::ConnectionHandler::max_message_size() + 1, 'x')));
+  send_raw(loop, peer.socket, make_data("after"));
+  CHECK(run_until({&server.handler}, [&]() { return !server.received.empty(); }));
+  CHECK(server.received == std::vector<std::string>{"after"});
+  CHECK(server.server.connections.contains(peer.accepted));
+}
+
+auto test_batched_broadcasts() -> void {
+  auto loop = winnet::LoopbackTransport{};
+  auto server = TestServer{loop};
+  server.handler.enable_batching(std::chrono::microseconds{0});
+  server.server.cb.on_recv_success = [&](winnet::Server *server, winnet::Connection &conn) {
+    // several messages queued in one tick go out as one batch packet
+    for (auto i = 0; i < 3; ++i) {
+      server->send_all(std::format("{}{}", conn.get_recv_string(), i));
+    }
+  };
+
+  auto client = winnet::Client{};
+  client.transport = &loop;
+  auto client_handler = winnet::ConnectionHandler{&client};
+  auto received = std::vector<std::string>{};
+  client.cb.on_recv_success = [&](winnet::Client *, winnet::Connection &conn) {
+    received.push_back(conn.get_recv_string());
+  };
+  CHECK(client.connect(client_handler, "127.0.0.1", std::to_string(TEST_PORT)));
+  client.connection->send(std::string{"m"});
+  loop.script_recv(client.connection->socket, {2, 0, 6, 1, 1});
+
+  CHECK(run_until({&server.handler, &client_handler}, [&]() { return received.size() == 3; }));
+  CHECK((received == std::vector<std::string>{"m0", "m1", "m2"}));
+}
+
+// property: however a stream of valid packets is cut into reads, the same messages come out in order
+auto test_header_parser_property() -> void {
+  auto random = std::mt19937{20261018};
+  const auto pick = [&](uint32_t low, uint32_t high) {
+    return std::uniform_int_distribution<uint32_t>{low, high}(random);
+  };
+
+  for (auto round = 0; round < 200 && failure_count == 0; ++round) {
+    auto loop = winnet::LoopbackTransport{};
+    auto server = TestServer{loop};
+    const auto peer = connect_raw(loop, server);
+
+    auto expected = std::vector<std::string>{};
+    auto stream = std::vector<char>{};
+    const auto packet_count = pick(1, 20);
+    for (auto i = uint32_t{0}; i < packet_count; ++i) {
+      // mostly short messages, sometimes empty ones or ones above the smallest buffer sizes
+      const auto size = pick(0, 9) == 0 ? pick(0, 4000) : pick(0, 40);
+      auto message = std::string(size, '\0');
+      for (auto &c : message) {
+        c = static_cast<char>(pick(0, 255));
+      }
+      expected.push_back(message);
+
+      const auto packet = make_data(message);
+      if (pick(0, 3) == 0) {
+        append(stream, winnet::make_packet(winnet::PacketType::batch, std::array{std::span<const char>{packet}}));
+      } else {
+        append(stream, packet);
+      }
+    }
+
+    auto script = std::vector<u_long>{};
+    for (auto covered = size_t{0}; covered < stream.size();) {
+      const auto cap = pick(0, 4) == 0 ? 0 : pick(1, 12);
+      script.push_back(cap);
+      covered += cap;
+    }
+    loop.script_recv(peer.accepted, script);
+
+    // the writer cuts the stream too, its pieces can arrive between the reads
+    for (auto offset = size_t{0}; offset < stream.size();) {
+      const auto size = std::min<size_t>(pick(1, 64), stream.size() - offset);
+      send_raw(loop, peer.socket, std::span{stream}.subspan(offset, size));
+      offset += size;
+    }
+
+    if (!CHECK(run_until({&server.handler}, [&]() { return server.received.size() == expected.size(); }))) {
+      std::cerr << std::format("round {}: got {} of {} messages\n", round, server.received.size(), expected.size());
+    }
+    CHECK(server.received == expected);
+  }
+}
+
+// fuzz: headers with any type and random bodies never fail the tick, and the server keeps accepting
+auto test_header_parser_fuzz() -> void {
+  auto random = std::mt19937{1018};
+  const auto pick = [&](uint32_t low, uint32_t high) {
+    return std::uniform_int_distribution<uint32_t>{low, high}(random);
+  };
+
+  auto loop = winnet::LoopbackTransport{};
+  auto server = TestServer{loop};
+  // session packets are handled too
+  server.server.enable_sessions(1024, std::chrono::seconds{1});
+  for (auto round = 0; round < 200; ++round) {
+    const auto peer = connect_raw(loop, server);
+
+    auto stream = std::vector<char>{};
+    const auto packet_count = pick(1, 10);
+    for (auto i = uint32_t{0}; i < packet_count; ++i) {
+      // the size stays small, a bogus size only makes the server wait for more bytes
+      const auto header = winnet::PacketHeader{
+        .packet_size = pick(0, 64),
+        .packet_type = static_cast<winnet::PacketType>(pick(0, 255)),
+      };
+      append(stream, std::span{std::bit_cast<const char *>(&header), sizeof(header)});
+      const auto body_size = pick(0, 3) == 0 ? pick(0, 64) : header.packet_size;
+      for (auto j = uint32_t{0}; j < body_size; ++j) {
+        stream.push_back(static_cast<char>(pick(0, 255)));
+      }
+    }
+    loop.script_recv(peer.accepted, {pick(0, 5), pick(0, 5), pick(1, 5)});
+    send_raw(loop, peer.socket, stream);
+
+    for (auto i = 0; i < 100; ++i) {
+      if (!CHECK(server.handler.tick(NO_WAIT))) {
+        return;
+      }
+    }
+
+    // the peer goes away, whatever state it left the connection in
+    loop.close(peer.socket);
+    CHECK(run_until({&server.handler}, [&]() { return !server.server.connections.contains(peer.accepted); }));
+  }
+  CHECK(server.server.connections.empty());
+}
+
+struct TestCase {
+  std::string_view name;
+  void (*run)();
+};
+
+const auto TEST_CASES = std::array{
+  TestCase{"split_header", test_split_header},
+  TestCase{"short_reads_and_writes", test_short_reads_and_writes},
+  TestCase{"zero_length_body", test_zero_length_body},
+  TestCase{"batch_unpacking", test_batch_unpacking},
+  TestCase{"oversized_header", test_oversized_header},
+  TestCase{"oversized_message", test_oversized_message},
+  TestCase{"batched_broadcasts", test_batched_broadcasts},
+  TestCase{"header_parser_property", test_header_parser_property},
+  TestCase{"header_parser_fuzz", test_header_parser_fuzz},
+};
+
+} // namespace
+
+auto main(int argc, char *argv[]) -> int {
+  const auto only = argc > 1 ? std::string_view{argv[1]} : std::string_view{};
+  auto ran = 0;
+  for (const auto &test_case : TEST_CASES) {
+    if (!only.empty() && test_case.name != only) {
+      continue;
+    }
+
+    const auto failures_before = failure_count;
+    test_case.run();
+    std::cout << std::format("{} {}\n", failure_count == failures_before ? "[pass]" : "[fail]", test_case.name);
+    ++ran;
+  }
+  utils::log_flush();
+
+  if (ran == 0) {
+    std::cerr << std::format("unknown test case: {}\n", only);
+    return EXIT_FAILURE;
+  }
+  return failure_count == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,208 @@
+#include "logger.hpp"
+
+#include <mutex>
+#include <chrono>
+#include <format>
+#include <memory>
+#include <thread>
+#include <vector>
+#include <iostream>
+
+namespace utils {
+
+namespace {
+
+class Logger {
+private:
+  std::mutex mutex;
+  std::vector<std::shared_ptr<LogRing>> rings;
+  std::atomic_bool stop_flag;
+  std::thread worker;
+
+  static auto format_arg(const LogRecord &record, const LogArg &arg, std::string_view spec, std::string &out)
+    -> void {
+    const auto format = std::string{"{"} + (spec.empty() ? "" : ":") + std::string{spec} + "}";
+    try {
+      format_value(record, arg, format, out);
+    } catch (const std::format_error &) {
+      // an exception would end the log thread (and the process), keep the rest of the record
+      out += "{?}";
+    }
+  }
+
+  static auto format_value(const LogRecord &record, const LogArg &arg, const std::string &format, std::string &out)
+    -> void {
+    switch (arg.type) {
+    case LogArg::Type::i64: {
+      const auto value = arg.i64;
+      out += std::vformat(format, std::make_format_args(value));
+      break;
+    }
+    case LogArg::Type::u64: {
+      const auto value = arg.u64;
+      out += std::vformat(format, std::make_format_args(value));
+      break;
+    }
+    case LogArg::Type::f64: {
+      const auto value = arg.f64;
+      out += std::vformat(format, std::make_format_args(value));
+      break;
+    }
+    case LogArg::Type::static_str: {
+      const auto value = std::string_view{arg.static_str};
+      out += std::vformat(format, std::make_format_args(value));
+      break;
+    }
+    case LogArg::Type::inline_str: {
+      const auto value = std::string_view{record.text.data() + arg.inline_str.offset, arg.inline_str.size};
+      out += std::vformat(format, std::make_format_args(value));
+      break;
+    }
+    }
+  }
+
+  // replace each `{...}` with the next argument, `{{` and `}}` are escapes like in std::format
+  static auto format_record(const LogRecord &record, std::string &out) -> void {
+    const auto format = std::string_view{record.format};
+    auto arg_index = size_t{0};
+    for (auto i = size_t{0}; i < format.size(); ++i) {
+      const auto c = format[i];
+      if ((c == '{' || c == '}') && i + 1 < format.size() && format[i + 1] == c) {
+        out += c;
+        ++i;
+        continue;
+      }
+      if (c != '{') {
+        out += c;
+        continue;
+      }
+
+      const auto end = format.find('}', i);
+      if (end == std::string_view::npos) {
+        out += format.substr(i);
+        break;
+      }
+      auto spec = format.substr(i + 1, end - i - 1);
+      if (!spec.empty() && spec.front() == ':') {
+        spec.remove_prefix(1);
+      }
+      if (arg_index < record.arg_count) {
+        format_arg(record, record.args[arg_index++], spec, out);
+      }
+      i = end;
+    }
+  }
+
+  auto drain() -> bool {
+    auto cur_rings = std::vector<std::shared_ptr<LogRing>>{};
+    {
+      const auto lock = std::scoped_lock{mutex};
+      cur_rings = rings;
+    }
+
+    auto out = std::string{};
+    auto err = std::string{};
+    auto tails = std::vector<size_t>(cur_rings.size());
+    for (auto i = size_t{0}; i < cur_rings.size(); ++i) {
+      const auto &ring = cur_rings[i];
+      tails[i] = ring->tail.load(std::memory_order_acquire);
+      for (auto head = ring->head.load(std::memory_order_relaxed); head != tails[i]; ++head) {
+        const auto &record = ring->records[head % LOG_RING_SIZE];
+        format_record(record, record.level == LogLevel::error ? err : out);
+      }
+
+      if (const auto dropped = ring->dropped.exchange(0, std::memory_order_relaxed); dropped > 0) {
+        err += std::format("[log] dropped {} records\n", dropped);
+      }
+    }
+
+    if (!out.empty()) {
+      std::cout << out << std::flush;
+    }
+    if (!err.empty()) {
+      std::cerr << err;
+    }
+
+    // hand the records back only after they are written so log_flush can wait on them
+    for (auto i = size_t{0}; i < cur_rings.size(); ++i) {
+      cur_rings[i]->head.store(tails[i], std::memory_order_release);
+    }
+    return !out.empty() || !err.empty();
+  }
+
+  auto run() -> void {
+    while (!stop_flag.load()) {
+      if (!drain()) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+      }
+    }
+    drain();
+  }
+
+public:
+  Logger() : mutex{}, rings{}, stop_flag{false}, worker{[this]() { run(); }} {}
+
+  ~Logger() {
+    stop_flag.store(true);
+    worker.join();
+  }
+
+  auto add_ring() -> std::shared_ptr<LogRing> {
+    auto ring = std::make_shared<LogRing>();
+    const auto lock = std::scoped_lock{mutex};
+    rings.push_back(ring);
+    return ring;
+  }
+
+  auto flush() -> void {
+    // the worker may be draining at the same time, wait until every ring is empty
+    auto cur_rings = std::vector<std::shared_ptr<LogRing>>{};
+    {
+      const auto lock = std::scoped_lock{mutex};
+      cur_rings = rings;
+    }
+    for (const auto &ring : cur_rings) {
+      while (ring->head.load(std::memory_order_acquire) != ring->tail.load(std::memory_order_acquire)) {
+        std::this_thread::yield();
+      }
+    }
+  }
+};
+
+auto logger() -> Logger & {
+  static auto instance = Logger{};
+  return instance;
+}
+
+thread_local auto thread_ring = std::shared_ptr<LogRing>{};
+thread_local auto thread_tail = size_t{0};
+
+} // namespace
+
+namespace detail {
+
+auto log_begin() -> LogRecord * {
+  if (thread_ring == nullptr) {
+    thread_ring = logger().add_ring();
+  }
+
+  thread_tail = thread_ring->tail.load(std::memory_order_relaxed);
+  if (thread_tail - thread_ring->head.load(std::memory_order_acquire) == LOG_RING_SIZE) {
+    thread_ring->dropped.fetch_add(1, std::memory_order_relaxed);
+    return nullptr;
+  }
+
+  return &thread_ring->records[thread_tail % LOG_RING_SIZE];
+}
+
+auto log_commit() -> void {
+  thread_ring->tail.store(thread_tail + 1, std::memory_order_release);
+}
+
+} // namespace detail
+
+auto log_flush() -> void {
+  logger().flush();
+}
+
+} // namespace utils
@@ -0,0 +1,157 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <algorithm>
+#include <format>
+#include <string>
+#include <cstdint>
+#include <concepts>
+#include <string_view>
+
+namespace utils {
+
+enum class LogLevel : uint8_t {
+  info,
+  error,
+};
+
+// string with static storage (like source_location::file_name), only the pointer is logged
+struct StaticString {
+  const char *str;
+};
+
+} // namespace utils
+
+// lets std::format_string check log calls with StaticString arguments
+template <>
+struct std::formatter<utils::StaticString> : std::formatter<std::string_view> {
+  auto format(utils::StaticString value, std::format_context &ctx) const {
+    return std::formatter<std::string_view>::format(value.str, ctx);
+  }
+};
+
+namespace utils {
+
+struct LogArg {
+  enum class Type : uint8_t {
+    i64,
+    u64,
+    f64,
+    static_str,
+    inline_str,
+  };
+
+  Type type;
+  union {
+    int64_t i64;
+    uint64_t u64;
+    double f64;
+    const char *static_str;
+    struct {
+      uint16_t offset;
+      uint16_t size;
+    } inline_str;
+  };
+};
+
+inline constexpr size_t LOG_MAX_ARGS = 8;
+inline constexpr size_t LOG_TEXT_SIZE = 240;
+inline constexpr size_t LOG_RING_SIZE = 512;
+
+// fixed size binary record, strings are copied into `text` and cut off when it is full
+struct LogRecord {
+  const char *format;
+  LogLevel level;
+  uint8_t arg_count;
+  uint16_t text_size;
+  std::array<LogArg, LOG_MAX_ARGS> args;
+  std::array<char, LOG_TEXT_SIZE> text;
+};
+
+// single producer single consumer ring, one per logging thread
+struct LogRing {
+  std::array<LogRecord, LOG_RING_SIZE> records;
+  alignas(64) std::atomic<size_t> head; // advanced by the log thread
+  alignas(64) std::atomic<size_t> tail; // advanced by the owning thread
+  std::atomic<uint64_t> dropped;
+};
+
+namespace detail {
+
+// reserve the next record of this thread's ring, nullptr when the ring is full
+auto log_begin() -> LogRecord *;
+auto log_commit() -> void;
+
+inline auto log_encode(LogRecord &record, LogArg &arg, std::string_view value) -> void {
+  const auto size = std::min(value.size(), LOG_TEXT_SIZE - record.text_size);
+  value.copy(record.text.data() + record.text_size, size);
+  arg.type = LogArg::Type::inline_str;
+  arg.inline_str = {
+    .offset = record.text_size,
+    .size = static_cast<uint16_t>(size),
+  };
+  record.text_size += static_cast<uint16_t>(size);
+}
+
+inline auto log_encode(LogRecord &, LogArg &arg, StaticString value) -> void {
+  arg.type = LogArg::Type::static_str;
+  arg.static_str = value.str;
+}
+
+template <std::signed_integral T>
+auto log_encode(LogRecord &, LogArg &arg, T value) -> void {
+  arg.type = LogArg::Type::i64;
+  arg.i64 = value;
+}
+
+template <std::unsigned_integral T>
+auto log_encode(LogRecord &, LogArg &arg, T value) -> void {
+  arg.type = LogArg::Type::u64;
+  arg.u64 = value;
+}
+
+template <std::floating_point T>
+auto log_encode(LogRecord &, LogArg &arg, T value) -> void {
+  arg.type = LogArg::Type::f64;
+  arg.f64 = value;
+}
+
+} // namespace detail
+
+// formatting and console output happen on a background thread
+// the caller only copies the arguments into a per thread ring (the record is dropped if the ring is full)
+// the format is checked against the arguments at compile time, the address of the literal goes into the record
+template <typename... Args>
+auto write_log(LogLevel level, std::format_string<const Args &...> format, const Args &...args) -> void {
+  static_assert(sizeof...(Args) <= LOG_MAX_ARGS, "too many log arguments");
+
+  auto record = detail::log_begin();
+  if (record == nullptr) {
+    return;
+  }
+
+  record->format = format.get().data();
+  record->level = level;
+  record->arg_count = static_cast<uint8_t>(sizeof...(Args));
+  record->text_size = 0;
+
+  auto index = size_t{0};
+  (detail::log_encode(*record, record->args[index++], args), ...);
+  detail::log_commit();
+}
+
+template <typename... Args>
+auto log_info(std::format_string<const Args &...> format, const Args &...args) -> void {
+  write_log<Args...>(LogLevel::info, format, args...);
+}
+
+template <typename... Args>
+auto log_error(std::format_string<const Args &...> format, const Args &...args) -> void {
+  write_log<Args...>(LogLevel::error, format, args...);
+}
+
+// write out everything logged so far, blocks until done
+auto log_flush() -> void;
+
+} // namespace utils
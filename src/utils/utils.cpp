@@ -1,4 +1,5 @@
 #include "utils.hpp"
+#include "logger.hpp"
 
 #include <io.h>
 #include <windows.h>
@@ -26,18 +27,18 @@ auto console_read_line() -> std::string {
   return input_utf8;
 }
 
-auto print_wsa_error(std::string msg, int err_code, const std::source_location &src_loc) -> void {
-  const auto file_name = src_loc.file_name();
+auto print_wsa_error(std::string_view msg, int err_code, const std::source_location &src_loc) -> void {
+  const auto file_name = StaticString{src_loc.file_name()};
   const auto line = src_loc.line();
   const auto column = src_loc.column();
-  const auto function_name = src_loc.function_name();
-  std::cerr << std::format("{} (error code: {})\n└>called from `{}` {}:{}:{}\n", msg, err_code, function_name,
-                           file_name, line, column);
+  const auto function_name = StaticString{src_loc.function_name()};
+  log_error("{} (error code: {})\n└>called from `{}` {}:{}:{}\n", msg, err_code, function_name, file_name, line,
+            column);
 }
 
-auto print_wsa_error(std::string msg, const std::source_location &src_loc) -> void {
+auto print_wsa_error(std::string_view msg, const std::source_location &src_loc) -> void {
   auto err_code = ::WSAGetLastError();
-  print_wsa_error(std::move(msg), err_code, src_loc);
+  print_wsa_error(msg, err_code, src_loc);
 }
 
 auto addr_to_string(IN_ADDR addr) -> std::string {
@@ -4,6 +4,8 @@
 
 #include <source_location>
 #include <string>
+#include <string_view>
+#include <vector>
 #include <functional>
 
 namespace utils {
@@ -23,12 +25,60 @@ struct DeferStruct {
     .defer_func = (func), \
   };
 
+// fixed capacity buffer that overwrites the oldest item when full, index 0 is the oldest
+template <typename T>
+class RingBuffer {
+private:
+  std::vector<T> items;
+  size_t head;
+  size_t count;
+
+public:
+  RingBuffer(size_t capacity) : items(capacity), head{0}, count{0} {}
+
+  auto capacity() const -> size_t {
+    return items.size();
+  }
+
+  auto size() const -> size_t {
+    return count;
+  }
+
+  auto empty() const -> bool {
+    return count == 0;
+  }
+
+  auto push_back(T item) -> void {
+    if (items.empty()) {
+      return;
+    }
+
+    if (count < items.size()) {
+      items[(head + count) % items.size()] = std::move(item);
+      count += 1;
+    } else {
+      items[head] = std::move(item);
+      head = (head + 1) % items.size();
+    }
+  }
+
+  auto operator[](size_t index) -> T & {
+    return items[(head + index) % items.size()];
+  }
+
+  auto operator[](size_t index) const -> const T & {
+    return items[(head + index) % items.size()];
+  }
+};
+
 auto console_read_line() -> std::string;
 
-auto print_wsa_error(std::string msg, int error_code,
+// goes through the async logger so error storms do not stall the caller on console output
+auto print_wsa_error(std::string_view msg, int error_code,
                      const std::source_location &src_loc = std::source_location::current()) -> void;
 
-auto print_wsa_error(std::string msg, const std::source_location &src_loc = std::source_location::current()) -> void;
+auto print_wsa_error(std::string_view msg,
+                     const std::source_location &src_loc = std::source_location::current()) -> void;
 
 auto addr_to_string(IN_ADDR addr) -> std::string;
 
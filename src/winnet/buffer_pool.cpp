@@ -0,0 +1,120 @@
+#include "buffer_pool.hpp"
+
+#include <bit>
+#include <algorithm>
+
+namespace winnet {
+
+namespace {
+
+// a thread keeps a few buffers of the first pool it uses without locking
+struct ThreadCache {
+  uint64_t pool_id;
+  std::array<std::vector<std::vector<char>>, BufferPool::CLASS_COUNT> buffers;
+};
+
+thread_local auto thread_cache = ThreadCache{};
+
+auto get_thread_cache(uint64_t pool_id) -> ThreadCache * {
+  if (thread_cache.pool_id == 0) {
+    thread_cache.pool_id = pool_id;
+  }
+  return thread_cache.pool_id == pool_id ? &thread_cache : nullptr;
+}
+
+// smallest class that fits `size`
+auto class_for_size(size_t size) -> size_t {
+  const auto shift = static_cast<size_t>(std::bit_width(std::max<size_t>(size, 1) - 1));
+  return std::max(shift, BufferPool::MIN_CLASS_SHIFT) - BufferPool::MIN_CLASS_SHIFT;
+}
+
+// largest class that `capacity` can serve
+auto class_for_capacity(size_t capacity) -> size_t {
+  return static_cast<size_t>(std::bit_width(capacity)) - 1 - BufferPool::MIN_CLASS_SHIFT;
+}
+
+} // namespace
+
+BufferPool::BufferPool(size_t max_free_per_class, size_t max_free_bytes_per_class)
+    : id{next_id++}, max_free_per_class{max_free_per_class}, max_free_bytes_per_class{max_free_bytes_per_class},
+      classes{}, hits{0}, misses{0}, resident_bytes{0} {}
+
+auto BufferPool::acquire(size_t size) -> std::vector<char> {
+  const auto class_index = class_for_size(size);
+  if (class_index >= CLASS_COUNT) {
+    misses.fetch_add(1, std::memory_order_relaxed);
+    return std::vector<char>(size);
+  }
+
+  auto buffer = std::vector<char>{};
+  if (auto cache = get_thread_cache(id); cache != nullptr && !cache->buffers[class_index].empty()) {
+    buffer = std::move(cache->buffers[class_index].back());
+    cache->buffers[class_index].pop_back();
+  } else {
+    auto &size_class = classes[class_index];
+    const auto lock = std::scoped_lock{size_class.mutex};
+    if (!size_class.buffers.empty()) {
+      buffer = std::move(size_class.buffers.back());
+      size_class.buffers.pop_back();
+    }
+  }
+
+  if (buffer.capacity() == 0) {
+    misses.fetch_add(1, std::memory_order_relaxed);
+    buffer.reserve(size_t{1} << (class_index + MIN_CLASS_SHIFT));
+  } else {
+    hits.fetch_add(1, std::memory_order_relaxed);
+    resident_bytes.fetch_sub(buffer.capacity(), std::memory_order_relaxed);
+  }
+
+  buffer.resize(size);
+  return buffer;
+}
+
+auto BufferPool::release(std::vector<char> &&buffer) -> void {
+  const auto capacity = buffer.capacity();
+  if (capacity < (size_t{1} << MIN_CLASS_SHIFT)) {
+    return;
+  }
+
+  const auto class_index = class_for_capacity(capacity);
+  if (class_index >= CLASS_COUNT) {
+    // too big to keep around, let it be freed
+    auto freed = std::move(buffer);
+    return;
+  }
+
+  buffer.clear();
+  // the byte limit applies to the thread cache as well, every thread that releases buffers has one
+  const auto limit = max_free(class_index);
+  if (auto cache = get_thread_cache(id);
+      cache != nullptr && cache->buffers[class_index].size() < std::min(THREAD_CACHE_SIZE, limit)) {
+    resident_bytes.fetch_add(capacity, std::memory_order_relaxed);
+    cache->buffers[class_index].push_back(std::move(buffer));
+    return;
+  }
+
+  auto &size_class = classes[class_index];
+  const auto lock = std::scoped_lock{size_class.mutex};
+  if (size_class.buffers.size() < limit) {
+    resident_bytes.fetch_add(capacity, std::memory_order_relaxed);
+    size_class.buffers.push_back(std::move(buffer));
+  } else {
+    auto freed = std::move(buffer);
+  }
+}
+
+auto BufferPool::stats() const -> BufferPoolStats {
+  return BufferPoolStats{
+    .hits = hits.load(std::memory_order_relaxed),
+    .misses = misses.load(std::memory_order_relaxed),
+    .resident_bytes = resident_bytes.load(std::memory_order_relaxed),
+  };
+}
+
+auto BufferPool::max_free(size_t class_index) const -> size_t {
+  const auto class_size = size_t{1} << (class_index + MIN_CLASS_SHIFT);
+  return std::min(max_free_per_class, std::max<size_t>(max_free_bytes_per_class / class_size, 1));
+}
+
+} // namespace winnet
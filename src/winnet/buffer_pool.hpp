@@ -0,0 +1,61 @@
+#pragma once
+
+#include <array>
+#include <mutex>
+#include <atomic>
+#include <vector>
+#include <cstdint>
+
+namespace winnet {
+
+struct BufferPoolStats {
+  uint64_t hits;
+  uint64_t misses;
+  // bytes held by free buffers, including the ones in thread caches
+  uint64_t resident_bytes;
+};
+
+// recycles byte buffers in power of two size classes so steady traffic does not allocate
+// larger buffers than the biggest class are allocated and freed as usual
+class BufferPool {
+public:
+  inline static constexpr size_t MIN_CLASS_SHIFT = 6;  // 64 B
+  inline static constexpr size_t MAX_CLASS_SHIFT = 20; // 1 MiB
+  inline static constexpr size_t CLASS_COUNT = MAX_CLASS_SHIFT - MIN_CLASS_SHIFT + 1;
+  inline static constexpr size_t THREAD_CACHE_SIZE = 32;
+  // large classes keep fewer buffers, 256 free 1 MiB buffers would pin 256 MiB after a burst
+  inline static constexpr size_t DEFAULT_MAX_FREE_BYTES_PER_CLASS = 4 * 1024 * 1024;
+
+private:
+  struct SizeClass {
+    std::mutex mutex;
+    std::vector<std::vector<char>> buffers;
+  };
+
+  inline static std::atomic<uint64_t> next_id = 1;
+
+  uint64_t id;
+  size_t max_free_per_class;
+  size_t max_free_bytes_per_class;
+  std::array<SizeClass, CLASS_COUNT> classes;
+  std::atomic<uint64_t> hits;
+  std::atomic<uint64_t> misses;
+  std::atomic<uint64_t> resident_bytes;
+
+public:
+  // a class keeps at most `max_free_per_class` free buffers and at most `max_free_bytes_per_class` bytes of them,
+  // but always at least one buffer
+  BufferPool(size_t max_free_per_class = 256, size_t max_free_bytes_per_class = DEFAULT_MAX_FREE_BYTES_PER_CLASS);
+  BufferPool(const BufferPool &) = delete;
+  auto operator=(const BufferPool &) -> BufferPool & = delete;
+
+  // the returned buffer has `size()` == size
+  auto acquire(size_t size) -> std::vector<char>;
+  auto release(std::vector<char> &&buffer) -> void;
+  auto stats() const -> BufferPoolStats;
+
+private:
+  auto max_free(size_t class_index) const -> size_t;
+};
+
+} // namespace winnet
@@ -0,0 +1,203 @@
+#define WIN32_LEAN_AND_MEAN
+
+#include "capture.hpp"
+
+#include <cstring>
+#include <format>
+#include <iostream>
+#include <algorithm>
+
+#include <windows.h>
+
+namespace winnet {
+
+CaptureLog::CaptureLog()
+    : file{INVALID_HANDLE_VALUE}, mapping{nullptr}, view{nullptr}, mapped_size{0}, used{0}, start_time{} {}
+
+CaptureLog::~CaptureLog() {
+  close();
+}
+
+auto CaptureLog::remap(size_t size) -> bool {
+  if (view != nullptr) {
+    ::UnmapViewOfFile(view);
+    view = nullptr;
+  }
+  if (mapping != nullptr) {
+    ::CloseHandle(mapping);
+    mapping = nullptr;
+  }
+
+  // mapping past the end of the file extends it
+  mapping = ::CreateFileMappingA(file, nullptr, PAGE_READWRITE, static_cast<DWORD>(size >> 32),
+                                 static_cast<DWORD>(size & 0xFFFFFFFF), nullptr);
+  if (mapping == nullptr) {
+    std::cerr << std::format("[capture error] CreateFileMapping failed (error code: {})\n", ::GetLastError());
+    return false;
+  }
+
+  view = static_cast<char *>(::MapViewOfFile(mapping, FILE_MAP_WRITE, 0, 0, size));
+  if (view == nullptr) {
+    std::cerr << std::format("[capture error] MapViewOfFile failed (error code: {})\n", ::GetLastError());
+    return false;
+  }
+
+  mapped_size = size;
+  return true;
+}
+
+auto CaptureLog::open(const std::string &path, size_t initial_size) -> bool {
+  close();
+
+  file = ::CreateFileA(path.c_str(), GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ, nullptr, CREATE_ALWAYS,
+                       FILE_ATTRIBUTE_NORMAL, nullptr);
+  if (file == INVALID_HANDLE_VALUE) {
+    std::cerr << std::format("[capture error] CreateFile failed (error code: {})\n", ::GetLastError());
+    return false;
+  }
+
+  if (!remap(std::max(initial_size, sizeof(CAPTURE_MAGIC)))) {
+    close();
+    return false;
+  }
+
+  std::memcpy(view, CAPTURE_MAGIC, sizeof(CAPTURE_MAGIC));
+  used = sizeof(CAPTURE_MAGIC);
+  start_time = std::chrono::steady_clock::now();
+  return true;
+}
+
+auto CaptureLog::close() -> void {
+  if (view != nullptr) {
+    ::FlushViewOfFile(view, used);
+    ::UnmapViewOfFile(view);
+    view = nullptr;
+  }
+  if (mapping != nullptr) {
+    ::CloseHandle(mapping);
+    mapping = nullptr;
+  }
+  if (file != INVALID_HANDLE_VALUE) {
+    // cut off the unused tail of the last mapping
+    auto end = LARGE_INTEGER{};
+    end.QuadPart = static_cast<LONGLONG>(used);
+    ::SetFilePointerEx(file, end, nullptr, FILE_BEGIN);
+    ::SetEndOfFile(file);
+    ::CloseHandle(file);
+    file = INVALID_HANDLE_VALUE;
+  }
+
+  mapped_size = 0;
+  used = 0;
+}
+
+auto CaptureLog::is_open() const -> bool {
+  return view != nullptr;
+}
+
+auto CaptureLog::append(uint64_t conn_id, CaptureDirection direction, uint8_t packet_type,
+                        std::span<const char> payload) -> bool {
+  if (view == nullptr) {
+    return false;
+  }
+
+  const auto record_size = sizeof(CaptureRecord) + payload.size();
+  if (used + record_size > mapped_size) {
+    if (!remap(std::max(mapped_size * 2, used + record_size))) {
+      close();
+      return false;
+    }
+  }
+
+  const auto elapsed = std::chrono::steady_clock::now() - start_time;
+  const auto record = CaptureRecord{
+    .timestamp_ns = static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count()),
+    .conn_id = conn_id,
+    .direction = direction,
+    .packet_type = packet_type,
+    .payload_size = static_cast<uint32_t>(payload.size()),
+  };
+  std::memcpy(view + used, &record, sizeof(record));
+  std::memcpy(view + used + sizeof(record), payload.data(), payload.size());
+  used += record_size;
+  return true;
+}
+
+CaptureReader::CaptureReader()
+    : file{INVALID_HANDLE_VALUE}, mapping{nullptr}, view{nullptr}, file_size{0}, offset{0} {}
+
+CaptureReader::~CaptureReader() {
+  close();
+}
+
+auto CaptureReader::open(const std::string &path) -> bool {
+  close();
+
+  file = ::CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL,
+                       nullptr);
+  if (file == INVALID_HANDLE_VALUE) {
+    std::cerr << std::format("[capture error] CreateFile failed (error code: {})\n", ::GetLastError());
+    return false;
+  }
+
+  auto size = LARGE_INTEGER{};
+  if (!::GetFileSizeEx(file, &size) || static_cast<size_t>(size.QuadPart) < sizeof(CAPTURE_MAGIC)) {
+    std::cerr << "[capture error] not a capture file\n";
+    close();
+    return false;
+  }
+  file_size = static_cast<size_t>(size.QuadPart);
+
+  mapping = ::CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+  if (mapping == nullptr) {
+    std::cerr << std::format("[capture error] CreateFileMapping failed (error code: {})\n", ::GetLastError());
+    close();
+    return false;
+  }
+
+  view = static_cast<const char *>(::MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0));
+  if (view == nullptr || std::memcmp(view, CAPTURE_MAGIC, sizeof(CAPTURE_MAGIC)) != 0) {
+    std::cerr << "[capture error] not a capture file\n";
+    close();
+    return false;
+  }
+
+  offset = sizeof(CAPTURE_MAGIC);
+  return true;
+}
+
+auto CaptureReader::close() -> void {
+  if (view != nullptr) {
+    ::UnmapViewOfFile(view);
+    view = nullptr;
+  }
+  if (mapping != nullptr) {
+    ::CloseHandle(mapping);
+    mapping = nullptr;
+  }
+  if (file != INVALID_HANDLE_VALUE) {
+    ::CloseHandle(file);
+    file = INVALID_HANDLE_VALUE;
+  }
+
+  file_size = 0;
+  offset = 0;
+}
+
+auto CaptureReader::next(CaptureRecord &record, std::span<const char> &payload) -> bool {
+  if (view == nullptr || file_size - offset < sizeof(CaptureRecord)) {
+    return false;
+  }
+
+  std::memcpy(&record, view + offset, sizeof(record));
+  // a log that was not closed properly ends with zeroed space
+  if (record.conn_id == 0 || file_size - offset - sizeof(record) < record.payload_size) {
+    return false;
+  }
+
+  payload = std::span{view + offset + sizeof(record), record.payload_size};
+  offset += sizeof(record) + record.payload_size;
+  return true;
+}
+
+} // namespace winnet
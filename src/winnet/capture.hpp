@@ -0,0 +1,78 @@
+#pragma once
+
+#include <span>
+#include <string>
+#include <chrono>
+#include <cstdint>
+
+#include <winsock2.h>
+
+namespace winnet {
+
+enum class CaptureDirection : uint8_t {
+  recv = 0,
+  send = 1,
+};
+
+inline constexpr char CAPTURE_MAGIC[8] = "WNCAP01";
+
+#pragma pack(push, 1)
+struct CaptureRecord {
+  uint64_t timestamp_ns; // since the capture was opened
+  uint64_t conn_id;
+  CaptureDirection direction;
+  uint8_t packet_type;
+  uint32_t payload_size;
+};
+#pragma pack(pop)
+
+// append only log of packets backed by a file mapping that grows as it fills up
+// the file is laid out as CAPTURE_MAGIC followed by (CaptureRecord + payload)...
+class CaptureLog {
+private:
+  HANDLE file;
+  HANDLE mapping;
+  char *view;
+  size_t mapped_size;
+  size_t used;
+  std::chrono::steady_clock::time_point start_time;
+
+  auto remap(size_t size) -> bool;
+
+public:
+  CaptureLog();
+  CaptureLog(const CaptureLog &) = delete;
+  auto operator=(const CaptureLog &) -> CaptureLog & = delete;
+  ~CaptureLog();
+
+  auto open(const std::string &path, size_t initial_size) -> bool;
+  auto close() -> void;
+  auto is_open() const -> bool;
+
+  auto append(uint64_t conn_id, CaptureDirection direction, uint8_t packet_type, std::span<const char> payload)
+    -> bool;
+};
+
+// read only view of a capture file
+class CaptureReader {
+private:
+  HANDLE file;
+  HANDLE mapping;
+  const char *view;
+  size_t file_size;
+  size_t offset;
+
+public:
+  CaptureReader();
+  CaptureReader(const CaptureReader &) = delete;
+  auto operator=(const CaptureReader &) -> CaptureReader & = delete;
+  ~CaptureReader();
+
+  auto open(const std::string &path) -> bool;
+  auto close() -> void;
+
+  // payload points into the mapping and stays valid until the reader is closed
+  auto next(CaptureRecord &record, std::span<const char> &payload) -> bool;
+};
+
+} // namespace winnet
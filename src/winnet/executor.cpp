@@ -0,0 +1,95 @@
+#include "executor.hpp"
+
+#include <algorithm>
+
+namespace winnet {
+
+Executor::Executor(size_t thread_count)
+    : workers{}, threads{}, stop_flag{false}, next_worker{0}, queued{0}, sleep_mutex{}, sleep_cv{} {
+  thread_count = std::max<size_t>(thread_count, 1);
+  for (auto i = size_t{0}; i < thread_count; ++i) {
+    workers.push_back(std::make_unique<Worker>());
+  }
+  for (auto i = size_t{0}; i < thread_count; ++i) {
+    threads.emplace_back([this, i]() { run(i); });
+  }
+}
+
+Executor::~Executor() {
+  {
+    const auto lock = std::scoped_lock{sleep_mutex};
+    stop_flag.store(true);
+  }
+  sleep_cv.notify_all();
+
+  for (auto &thread : threads) {
+    thread.join();
+  }
+}
+
+auto Executor::thread_count() const -> size_t {
+  return threads.size();
+}
+
+auto Executor::submit(std::function<void()> task) -> void {
+  auto &worker = *workers[next_worker.fetch_add(1) % workers.size()];
+  {
+    const auto lock = std::scoped_lock{worker.mutex};
+    worker.tasks.push_back(std::move(task));
+  }
+
+  {
+    // taking the lock makes sure a worker that is about to sleep sees the new task
+    const auto lock = std::scoped_lock{sleep_mutex};
+    queued.fetch_add(1);
+  }
+  sleep_cv.notify_one();
+}
+
+auto Executor::try_pop(size_t index, std::function<void()> &task) -> bool {
+  auto &worker = *workers[index];
+  const auto lock = std::scoped_lock{worker.mutex};
+  if (worker.tasks.empty()) {
+    return false;
+  }
+
+  // newest first, its data is most likely still in cache
+  task = std::move(worker.tasks.back());
+  worker.tasks.pop_back();
+  return true;
+}
+
+auto Executor::try_steal(size_t index, std::function<void()> &task) -> bool {
+  for (auto offset = size_t{1}; offset < workers.size(); ++offset) {
+    auto &victim = *workers[(index + offset) % workers.size()];
+    const auto lock = std::scoped_lock{victim.mutex};
+    if (!victim.tasks.empty()) {
+      // oldest first, the opposite end of what the owner pops
+      task = std::move(victim.tasks.front());
+      victim.tasks.pop_front();
+      return true;
+    }
+  }
+
+  return false;
+}
+
+auto Executor::run(size_t index) -> void {
+  auto task = std::function<void()>{};
+  while (true) {
+    if (try_pop(index, task) || try_steal(index, task)) {
+      queued.fetch_sub(1);
+      task();
+      task = nullptr;
+      continue;
+    }
+
+    auto lock = std::unique_lock{sleep_mutex};
+    sleep_cv.wait(lock, [this]() { return stop_flag.load() || queued.load() > 0; });
+    if (stop_flag.load() && queued.load() == 0) {
+      return;
+    }
+  }
+}
+
+} // namespace winnet
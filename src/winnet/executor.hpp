@@ -0,0 +1,45 @@
+#pragma once
+
+#include <mutex>
+#include <deque>
+#include <atomic>
+#include <memory>
+#include <thread>
+#include <vector>
+#include <functional>
+#include <condition_variable>
+
+namespace winnet {
+
+// thread pool where every worker has its own task queue and idle workers steal from the others
+class Executor {
+private:
+  struct Worker {
+    std::mutex mutex;
+    std::deque<std::function<void()>> tasks;
+  };
+
+  std::vector<std::unique_ptr<Worker>> workers;
+  std::vector<std::thread> threads;
+  std::atomic_bool stop_flag;
+  std::atomic<size_t> next_worker;
+  std::atomic<size_t> queued;
+  std::mutex sleep_mutex;
+  std::condition_variable sleep_cv;
+
+  auto try_pop(size_t index, std::function<void()> &task) -> bool;
+  auto try_steal(size_t index, std::function<void()> &task) -> bool;
+  auto run(size_t index) -> void;
+
+public:
+  Executor(size_t thread_count);
+  Executor(const Executor &) = delete;
+  auto operator=(const Executor &) -> Executor & = delete;
+  // runs the tasks that are still queued before returning
+  ~Executor();
+
+  auto thread_count() const -> size_t;
+  auto submit(std::function<void()> task) -> void;
+};
+
+} // namespace winnet
@@ -0,0 +1,519 @@
+#define WIN32_LEAN_AND_MEAN
+
+#include "handoff.hpp"
+#include "winnet.hpp"
+
+#include <cstring>
+#include <algorithm>
+
+#include <windows.h>
+#include <afunix.h>
+#include <sddl.h>
+
+#include <utils.hpp>
+#include <logger.hpp>
+
+namespace winnet {
+
+namespace {
+
+template <typename T>
+auto write_value(std::vector<char> &out, const T &value) -> void {
+  const auto offset = out.size();
+  out.resize(offset + sizeof(T));
+  std::memcpy(out.data() + offset, &value, sizeof(T));
+}
+
+auto write_bytes(std::vector<char> &out, std::span<const char> bytes) -> void {
+  write_value(out, static_cast<uint32_t>(bytes.size()));
+  out.insert(out.end(), bytes.begin(), bytes.end());
+}
+
+template <typename T>
+auto read_value(std::span<const char> &in, T &value) -> bool {
+  if (in.size() < sizeof(T)) {
+    return false;
+  }
+  std::memcpy(&value, in.data(), sizeof(T));
+  in = in.subspan(sizeof(T));
+  return true;
+}
+
+auto read_bytes(std::span<const char> &in, std::vector<char> &out, BufferPool &buffer_pool) -> bool {
+  auto size = uint32_t{0};
+  if (!read_value(in, size) || in.size() < size) {
+    return false;
+  }
+  out = size == 0 ? std::vector<char>{} : buffer_pool.acquire(size);
+  std::memcpy(out.data(), in.data(), size);
+  in = in.subspan(size);
+  return true;
+}
+
+auto send_exact(SOCKET sock, std::span<const char> data) -> bool {
+  while (!data.empty()) {
+    const auto sent = ::send(sock, data.data(), static_cast<int>(std::min(data.size(), size_t{INT_MAX})), 0);
+    if (sent == SOCKET_ERROR) {
+      utils::print_wsa_error("[winsock error] handoff send failed");
+      return false;
+    }
+    data = data.subspan(sent);
+  }
+  return true;
+}
+
+auto recv_exact(SOCKET sock, std::span<char> data) -> bool {
+  while (!data.empty()) {
+    const auto received = ::recv(sock, data.data(), static_cast<int>(std::min(data.size(), size_t{INT_MAX})), 0);
+    if (received == SOCKET_ERROR) {
+      utils::print_wsa_error("[winsock error] handoff recv failed");
+      return false;
+    }
+    if (received == 0) {
+      // the other process went away
+      return false;
+    }
+    data = data.subspan(received);
+  }
+  return true;
+}
+
+// only the user running this server (and the system) may connect to the socket file
+auto restrict_access(const std::string &path) -> bool {
+  auto descriptor = PSECURITY_DESCRIPTOR{nullptr};
+  if (!::ConvertStringSecurityDescriptorToSecurityDescriptorA("D:P(A;;FA;;;OW)(A;;FA;;;SY)", SDDL_REVISION_1,
+                                                              &descriptor, nullptr)) {
+    utils::log_error("[handoff error] building the socket file acl failed (error code: {})\n", ::GetLastError());
+    return false;
+  }
+  defer([&]() { ::LocalFree(descriptor); });
+
+  if (!::SetFileSecurityA(path.c_str(), DACL_SECURITY_INFORMATION | PROTECTED_DACL_SECURITY_INFORMATION,
+                          descriptor)) {
+    utils::log_error("[handoff error] restricting {} failed (error code: {})\n", path, ::GetLastError());
+    return false;
+  }
+  return true;
+}
+
+// the process id the new process sends has to be the one the kernel reports for the other end of the socket,
+// or any local process could have every socket duplicated into a process of its choice
+auto read_process_id(SOCKET sock, DWORD &process_id) -> bool {
+  auto claimed_id = uint32_t{0};
+  if (!recv_exact(sock, std::span{std::bit_cast<char *>(&claimed_id), sizeof(claimed_id)})) {
+    return false;
+  }
+
+  auto peer_id = ULONG{0};
+  auto returned = DWORD{0};
+  if (::WSAIoctl(sock, SIO_AF_UNIX_GETPEERPID, nullptr, 0, &peer_id, sizeof(peer_id), &returned, nullptr,
+                 nullptr) == SOCKET_ERROR) {
+    utils::print_wsa_error("[winsock error] handoff peer process id query failed");
+    return false;
+  }
+  if (peer_id != claimed_id) {
+    utils::log_error("[handoff error] process {} claimed to be process {}, refused\n", peer_id, claimed_id);
+    return false;
+  }
+
+  process_id = peer_id;
+  return true;
+}
+
+auto make_unix_addr(const std::string &path, sockaddr_un &addr) -> bool {
+  if (path.size() >= sizeof(addr.sun_path)) {
+    utils::log_error("[handoff error] path is too long: {}\n", path);
+    return false;
+  }
+  addr = sockaddr_un{};
+  addr.sun_family = AF_UNIX;
+  std::memcpy(addr.sun_path, path.data(), path.size());
+  return true;
+}
+
+auto open_duplicate(WSAPROTOCOL_INFOW &info) -> SOCKET {
+  const auto sock =
+    ::WSASocketW(FROM_PROTOCOL_INFO, FROM_PROTOCOL_INFO, FROM_PROTOCOL_INFO, &info, 0, WSA_FLAG_OVERLAPPED);
+  if (sock == INVALID_SOCKET) {
+    utils::print_wsa_error("[winsock error] opening handed over socket failed");
+  }
+  return sock;
+}
+
+} // namespace
+
+Handoff::Handoff()
+    : listen_socket{INVALID_SOCKET}, peer_socket{INVALID_SOCKET}, peer_process_id{0}, path{}, on_request{}, mutex{},
+      worker{} {}
+
+Handoff::~Handoff() {
+  close();
+}
+
+auto Handoff::listen(const std::string &path, std::function<void()> on_request) -> bool {
+  auto addr = sockaddr_un{};
+  if (!make_unix_addr(path, addr)) {
+    return false;
+  }
+
+  // a socket file left by a process that crashed would make bind fail
+  ::DeleteFileA(path.c_str());
+
+  listen_socket = ::socket(AF_UNIX, SOCK_STREAM, 0);
+  if (listen_socket == INVALID_SOCKET) {
+    utils::print_wsa_error("[winsock error] handoff socket creation failed");
+    return false;
+  }
+
+  if (::bind(listen_socket, std::bit_cast<sockaddr *>(&addr), sizeof(addr)) == SOCKET_ERROR) {
+    utils::print_wsa_error("[winsock error] handoff bind failed");
+    ::closesocket(listen_socket);
+    listen_socket = INVALID_SOCKET;
+    return false;
+  }
+
+  // before listen, nobody can connect until the file is locked down
+  if (!restrict_access(path)) {
+    ::closesocket(listen_socket);
+    listen_socket = INVALID_SOCKET;
+    ::DeleteFileA(path.c_str());
+    return false;
+  }
+
+  if (::listen(listen_socket, 1) == SOCKET_ERROR) {
+    utils::print_wsa_error("[winsock error] handoff listen failed");
+    ::closesocket(listen_socket);
+    listen_socket = INVALID_SOCKET;
+    return false;
+  }
+
+  this->path = path;
+  this->on_request = std::move(on_request);
+  worker = std::thread{[this]() {
+    while (true) {
+      // fails once close() closes the listen socket
+      const auto sock = ::accept(listen_socket, nullptr, nullptr);
+      if (sock == INVALID_SOCKET) {
+        return;
+      }
+
+      // the io thread blocks on this socket while it waits for the ack, a new process that hangs must not stall it
+      const auto timeout = PEER_TIMEOUT_MS;
+      const auto timeout_bytes = std::bit_cast<const char *>(&timeout);
+      auto process_id = DWORD{0};
+      if (::setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, timeout_bytes, sizeof(timeout)) == SOCKET_ERROR ||
+          ::setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, timeout_bytes, sizeof(timeout)) == SOCKET_ERROR) {
+        utils::print_wsa_error("[winsock error] handoff socket timeout failed");
+        ::closesocket(sock);
+        continue;
+      }
+      // read here rather than in send, so the io thread is only involved once a verified peer is waiting
+      if (!read_process_id(sock, process_id)) {
+        ::closesocket(sock);
+        continue;
+      }
+
+      {
+        const auto lock = std::scoped_lock{mutex};
+        peer_socket = sock;
+        peer_process_id = process_id;
+      }
+      this->on_request();
+      return;
+    }
+  }};
+
+  return true;
+}
+
+auto Handoff::relisten() -> bool {
+  // the worker returned after accepting the failed attempt
+  if (listen_socket != INVALID_SOCKET) {
+    ::closesocket(listen_socket);
+    listen_socket = INVALID_SOCKET;
+  }
+  if (worker.joinable()) {
+    worker.join();
+  }
+
+  const auto cur_path = path;
+  return listen(cur_path, std::move(on_request));
+}
+
+auto Handoff::close() -> void {
+  if (listen_socket != INVALID_SOCKET) {
+    ::closesocket(listen_socket);
+    listen_socket = INVALID_SOCKET;
+  }
+  if (worker.joinable()) {
+    worker.join();
+  }
+
+  const auto lock = std::scoped_lock{mutex};
+  if (peer_socket != INVALID_SOCKET) {
+    ::closesocket(peer_socket);
+    peer_socket = INVALID_SOCKET;
+  }
+  if (!path.empty()) {
+    ::DeleteFileA(path.c_str());
+    path.clear();
+  }
+}
+
+auto Handoff::write_connection(std::vector<char> &out, Connection &conn, DWORD process_id) -> bool {
+  auto info = WSAPROTOCOL_INFOW{};
+  if (::WSADuplicateSocketW(conn.socket, process_id, &info) == SOCKET_ERROR) {
+    utils::print_wsa_error("[winsock error] WSADuplicateSocket failed");
+    return false;
+  }
+
+  // batched messages go out with the rest of the queue
+  conn.flush_batch();
+
+  write_value(out, info);
+  write_value(out, conn.addr_info);
+  write_bytes(out, conn.username);
+  write_value(out, conn.peer_capabilities);
+  write_value(out, static_cast<uint8_t>(conn.is_batching));
+  write_value(out, static_cast<uint8_t>(conn.is_started));
+  write_value(out, static_cast<uint8_t>(conn.is_link));
+  write_value(out, conn.link_node_id);
+  write_bytes(out, conn.link_target);
+
+  // a packet that is partly received continues where it stopped
+  write_value(out, conn.recv_header);
+  write_value(out, static_cast<uint8_t>(conn.is_recv_header));
+  write_value(out, conn.recv_total_size);
+  write_value(out, conn.cur_recv_amount);
+  write_value(out, conn.recv_packet_type);
+  write_bytes(out, conn.recv_buf);
+
+  // and so does a frame that is partly sent
+  write_bytes(out, conn.send_buf);
+  write_value(out, conn.cur_send_amount);
+
+  const auto lock = std::scoped_lock{conn.send_queue.mutex};
+  for (const auto &lane : conn.send_queue.lanes) {
+    // copied, the old process keeps serving if the handoff fails
+    auto frames = lane;
+    write_value(out, static_cast<uint32_t>(frames.size()));
+    while (!frames.empty()) {
+      write_bytes(out, frames.front());
+      frames.pop();
+    }
+  }
+
+  return true;
+}
+
+auto Handoff::read_connection(std::span<const char> &in, ConnectionHandler &handler) -> bool {
+  auto &buffer_pool = handler.net_entity->buffer_pool;
+
+  auto info = WSAPROTOCOL_INFOW{};
+  auto addr_info = SOCKADDR_IN{};
+  if (!read_value(in, info) || !read_value(in, addr_info)) {
+    return false;
+  }
+
+  const auto sock = open_duplicate(info);
+  if (sock == INVALID_SOCKET) {
+    return false;
+  }
+
+  auto conn = Connection{sock, addr_info};
+  conn.buffer_pool = &buffer_pool;
+  conn.transport = handler.net_entity->transport;
+
+  auto username = std::vector<char>{};
+  auto link_target = std::vector<char>{};
+  auto is_batching = uint8_t{0};
+  auto is_started = uint8_t{0};
+  auto is_link = uint8_t{0};
+  auto is_recv_header = uint8_t{0};
+  auto ok = read_bytes(in, username, buffer_pool) && read_value(in, conn.peer_capabilities) &&
+            read_value(in, is_batching) && read_value(in, is_started) && read_value(in, is_link) &&
+            read_value(in, conn.link_node_id) && read_bytes(in, link_target, buffer_pool) &&
+            read_value(in, conn.recv_header) && read_value(in, is_recv_header) &&
+            read_value(in, conn.recv_total_size) && read_value(in, conn.cur_recv_amount) &&
+            read_value(in, conn.recv_packet_type) && read_bytes(in, conn.recv_buf, buffer_pool) &&
+            read_bytes(in, conn.send_buf, buffer_pool) && read_value(in, conn.cur_send_amount);
+
+  for (auto &lane : conn.send_queue.lanes) {
+    auto count = uint32_t{0};
+    ok = ok && read_value(in, count);
+    for (auto i = uint32_t{0}; ok && i < count; ++i) {
+      auto frame = std::vector<char>{};
+      ok = read_bytes(in, frame, buffer_pool);
+      lane.push(std::move(frame));
+    }
+  }
+
+  if (!ok) {
+    ::closesocket(sock);
+    return false;
+  }
+
+  conn.username = std::string{username.begin(), username.end()};
+  conn.is_batching = is_batching != 0;
+  conn.is_started = is_started != 0;
+  conn.is_link = is_link != 0;
+  conn.link_target = std::string{link_target.begin(), link_target.end()};
+  conn.is_recv_header = is_recv_header != 0;
+
+  FD_SET(sock, &handler.read_set);
+  FD_SET(sock, &handler.write_set);
+  handler.net_entity->connections.insert({sock, std::move(conn)});
+  return true;
+}
+
+auto Handoff::send(Server *server, ConnectionHandler &handler, bool with_connections) -> bool {
+  const auto lock = std::scoped_lock{mutex};
+  if (peer_socket == INVALID_SOCKET) {
+    return false;
+  }
+
+  const auto is_sent = send_state(server, handler, with_connections);
+
+  // on failure the new process sees the socket close and exits, which also frees the handles duplicated into it
+  ::closesocket(peer_socket);
+  peer_socket = INVALID_SOCKET;
+
+  if (is_sent) {
+    // the path belongs to the new process now
+    path.clear();
+  } else if (!relisten()) {
+    utils::log_error("[handoff error] waiting for the next attempt failed: {}\n", path);
+  }
+  return is_sent;
+}
+
+auto Handoff::send_state(Server *server, ConnectionHandler &handler, bool with_connections) -> bool {
+  const auto process_id = peer_process_id;
+
+  // the new process binds the same path for the next restart once it has everything
+  ::DeleteFileA(path.c_str());
+
+  auto out = std::vector<char>(sizeof(uint64_t));
+  out.insert(out.end(), std::begin(HANDOFF_MAGIC), std::end(HANDOFF_MAGIC));
+  write_value(out, server->port);
+
+  auto listen_info = WSAPROTOCOL_INFOW{};
+  if (::WSADuplicateSocketW(server->listen_socket, process_id, &listen_info) == SOCKET_ERROR) {
+    utils::print_wsa_error("[winsock error] WSADuplicateSocket failed");
+    return false;
+  }
+  write_value(out, listen_info);
+
+  // links that are still connecting are dropped, the new process dials them again
+  const auto is_connected = [](const auto &entry) { return !entry.second.is_connecting; };
+  const auto count = with_connections ? std::ranges::count_if(server->connections, is_connected) : 0;
+  write_value(out, static_cast<uint32_t>(count));
+  if (with_connections) {
+    for (auto &[sock, conn] : server->connections) {
+      if (conn.is_connecting) {
+        continue;
+      }
+      if (!write_connection(out, conn, process_id)) {
+        return false;
+      }
+    }
+  }
+
+  const auto payload_size = static_cast<uint64_t>(out.size() - sizeof(uint64_t));
+  std::memcpy(out.data(), &payload_size, sizeof(payload_size));
+  if (!send_exact(peer_socket, out)) {
+    return false;
+  }
+
+  auto ack = uint8_t{0};
+  if (!recv_exact(peer_socket, std::span{std::bit_cast<char *>(&ack), sizeof(ack)}) || ack != 1) {
+    utils::log_error("[handoff error] the new process did not take over\n");
+    return false;
+  }
+
+  // the new process owns the sockets now, close our handles without shutting them down
+  FD_CLR(server->listen_socket, &handler.read_set);
+  ::closesocket(server->listen_socket);
+  server->listen_socket = INVALID_SOCKET;
+
+  if (with_connections) {
+    const auto now = server->transport->now();
+    for (auto &[sock, conn] : server->connections) {
+      FD_CLR(sock, &handler.read_set);
+      FD_CLR(sock, &handler.write_set);
+      FD_CLR(sock, &handler.err_set);
+      ::closesocket(sock);
+      if (conn.session != nullptr) {
+        // detached like on a disconnect, so it is not expired right away
+        conn.session->username = conn.username;
+        conn.session->socket = INVALID_SOCKET;
+        conn.session->detached_at = now;
+      }
+    }
+    server->connections.clear();
+  }
+
+  return true;
+}
+
+auto Handoff::receive(const std::string &path, Server *server, ConnectionHandler &handler) -> bool {
+  auto addr = sockaddr_un{};
+  if (!make_unix_addr(path, addr)) {
+    return false;
+  }
+
+  const auto sock = ::socket(AF_UNIX, SOCK_STREAM, 0);
+  if (sock == INVALID_SOCKET) {
+    utils::print_wsa_error("[winsock error] handoff socket creation failed");
+    return false;
+  }
+  defer([=] { ::closesocket(sock); });
+
+  if (::connect(sock, std::bit_cast<sockaddr *>(&addr), sizeof(addr)) == SOCKET_ERROR) {
+    utils::print_wsa_error("[winsock error] handoff connect failed");
+    return false;
+  }
+
+  const auto process_id = static_cast<uint32_t>(::GetCurrentProcessId());
+  if (!send_exact(sock, std::span{std::bit_cast<const char *>(&process_id), sizeof(process_id)})) {
+    return false;
+  }
+
+  auto payload_size = uint64_t{0};
+  if (!recv_exact(sock, std::span{std::bit_cast<char *>(&payload_size), sizeof(payload_size)})) {
+    return false;
+  }
+  auto payload = std::vector<char>(payload_size);
+  if (!recv_exact(sock, payload)) {
+    return false;
+  }
+
+  auto in = std::span<const char>{payload};
+  auto magic = std::array<char, sizeof(HANDOFF_MAGIC)>{};
+  if (!read_value(in, magic) || std::memcmp(magic.data(), HANDOFF_MAGIC, sizeof(HANDOFF_MAGIC)) != 0) {
+    utils::log_error("[handoff error] unknown handoff format\n");
+    return false;
+  }
+
+  auto listen_info = WSAPROTOCOL_INFOW{};
+  auto conn_count = uint32_t{0};
+  if (!read_value(in, server->port) || !read_value(in, listen_info)) {
+    return false;
+  }
+  server->listen_socket = open_duplicate(listen_info);
+  if (server->listen_socket == INVALID_SOCKET || !read_value(in, conn_count)) {
+    return false;
+  }
+
+  for (auto i = uint32_t{0}; i < conn_count; ++i) {
+    if (!read_connection(in, handler)) {
+      utils::log_error("[handoff error] connection {} of {} could not be restored\n", i, conn_count);
+      return false;
+    }
+  }
+
+  const auto ack = uint8_t{1};
+  return send_exact(sock, std::span{std::bit_cast<const char *>(&ack), sizeof(ack)});
+}
+
+} // namespace winnet
@@ -0,0 +1,70 @@
+#pragma once
+
+#include <mutex>
+#include <span>
+#include <string>
+#include <thread>
+#include <vector>
+#include <cstdint>
+#include <functional>
+
+#include <winsock2.h>
+
+namespace winnet {
+
+class Server;
+struct Connection;
+struct ConnectionHandler;
+
+inline constexpr char HANDOFF_MAGIC[8] = "WNHOF02";
+
+// hands the listen socket and the live connections of a server over to a new process on the same machine
+// windows has no SCM_RIGHTS, so every socket is duplicated into the new process with WSADuplicateSocketW
+// and its WSAPROTOCOL_INFOW is sent over an AF_UNIX socket together with the framing and send queue state
+// the socket file only admits the same user, and the process id has to match the peer of the socket
+//
+// new -> old: uint32_t process id
+// old -> new: uint64_t size, HANDOFF_MAGIC, listen socket, connections...
+// new -> old: uint8_t 1 once every socket is opened, the old process may close its handles after that
+class Handoff {
+private:
+  // bounds every blocking read and write on the peer socket, the ack is waited for on the io thread
+  inline static constexpr DWORD PEER_TIMEOUT_MS = 10'000;
+
+  SOCKET listen_socket;
+  SOCKET peer_socket;
+  // verified against the peer of `peer_socket` before on_request is called
+  DWORD peer_process_id;
+  std::string path;
+  std::function<void()> on_request;
+  std::mutex mutex;
+  std::thread worker;
+
+  // wait for another attempt after a failed one, the path was already given up for the new process
+  auto relisten() -> bool;
+  auto send_state(Server *server, ConnectionHandler &handler, bool with_connections) -> bool;
+  static auto write_connection(std::vector<char> &out, Connection &conn, DWORD process_id) -> bool;
+  static auto read_connection(std::span<const char> &in, ConnectionHandler &handler) -> bool;
+
+public:
+  Handoff();
+  Handoff(const Handoff &) = delete;
+  auto operator=(const Handoff &) -> Handoff & = delete;
+  ~Handoff();
+
+  // old process: wait in the background for a new process to connect to `path`
+  // `on_request` is called from the background thread, post the actual send to the io thread
+  auto listen(const std::string &path, std::function<void()> on_request) -> bool;
+  auto close() -> void;
+
+  // old process, on the io thread: give everything to the new process
+  // connections are closed without shutdown and without on_conn_ended, the peers do not notice
+  // sessions stay behind detached, a handed over connection continues without one
+  // on failure nothing is handed over and the old process waits on the same path for another attempt
+  auto send(Server *server, ConnectionHandler &handler, bool with_connections) -> bool;
+
+  // new process, instead of Server::init and Server::listen
+  static auto receive(const std::string &path, Server *server, ConnectionHandler &handler) -> bool;
+};
+
+} // namespace winnet
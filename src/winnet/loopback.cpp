@@ -0,0 +1,345 @@
+#define WIN32_LEAN_AND_MEAN
+
+#include "loopback.hpp"
+
+#include <cstring>
+#include <algorithm>
+
+namespace winnet {
+
+namespace {
+
+auto loopback_addr(uint16_t port) -> SOCKADDR_IN {
+  auto addr = SOCKADDR_IN{};
+  addr.sin_family = AF_INET;
+  addr.sin_addr.S_un.S_addr = ::htonl(INADDR_LOOPBACK);
+  addr.sin_port = ::htons(port);
+  return addr;
+}
+
+} // namespace
+
+LoopbackTransport::LoopbackTransport()
+    : endpoints{}, listeners{}, ports{}, refused{}, default_config{}, next_socket{0x10000}, next_port{49152}, error{0},
+      // the handler treats time_point{} as unset, start somewhere else
+      clock{std::chrono::hours{1}} {}
+
+auto LoopbackTransport::new_socket() -> SOCKET {
+  return next_socket++;
+}
+
+auto LoopbackTransport::is_readable(const Endpoint &endpoint) const -> bool {
+  if (endpoint.inbox.empty()) {
+    // end of stream
+    return endpoint.peer == INVALID_SOCKET || endpoint.is_peer_shutdown;
+  }
+  return endpoint.inbox.front().ready_at <= clock;
+}
+
+auto LoopbackTransport::next_arrival() const -> std::chrono::steady_clock::time_point {
+  auto arrival = std::chrono::steady_clock::time_point::max();
+  for (const auto &[sock, endpoint] : endpoints) {
+    if (!endpoint.inbox.empty() && endpoint.inbox.front().ready_at > clock) {
+      arrival = std::min(arrival, endpoint.inbox.front().ready_at);
+    }
+  }
+  return arrival;
+}
+
+auto LoopbackTransport::fail(int error_code) -> int {
+  error = error_code;
+  return SOCKET_ERROR;
+}
+
+auto LoopbackTransport::set_link_config(LinkConfig config) -> void {
+  default_config = config;
+}
+
+auto LoopbackTransport::script_recv(SOCKET sock, std::vector<u_long> sizes) -> void {
+  auto &script = endpoints.at(sock).recv_script;
+  script.insert(script.end(), sizes.begin(), sizes.end());
+}
+
+auto LoopbackTransport::script_send(SOCKET sock, std::vector<u_long> sizes) -> void {
+  auto &script = endpoints.at(sock).send_script;
+  script.insert(script.end(), sizes.begin(), sizes.end());
+}
+
+auto LoopbackTransport::inject(SOCKET sock, std::span<const char> bytes) -> void {
+  endpoints.at(sock).inbox.push_back(Segment{
+    .ready_at = clock,
+    .bytes = std::vector<char>{bytes.begin(), bytes.end()},
+    .offset = 0,
+  });
+}
+
+auto LoopbackTransport::advance(std::chrono::microseconds duration) -> void {
+  clock += duration;
+}
+
+auto LoopbackTransport::bind(uint16_t port) -> SOCKET {
+  if (port == 0) {
+    while (ports.contains(next_port)) {
+      ++next_port;
+    }
+    port = next_port++;
+  }
+  if (ports.contains(port)) {
+    fail(WSAEADDRINUSE);
+    return INVALID_SOCKET;
+  }
+
+  const auto sock = new_socket();
+  listeners.insert({sock, Listener{.port = port, .is_listening = false, .backlog = {}}});
+  ports.insert({port, sock});
+  return sock;
+}
+
+auto LoopbackTransport::listen(SOCKET sock) -> int {
+  auto it = listeners.find(sock);
+  if (it == listeners.end()) {
+    return fail(WSAENOTSOCK);
+  }
+  it->second.is_listening = true;
+  return 0;
+}
+
+auto LoopbackTransport::connect(const std::string &, const std::string &port, SOCKADDR_IN &addr) -> SOCKET {
+  // every address is this process
+  const auto port_number = static_cast<uint16_t>(std::stoi(port));
+  auto it = ports.find(port_number);
+  if (it == ports.end() || !listeners.at(it->second).is_listening) {
+    fail(WSAECONNREFUSED);
+    return INVALID_SOCKET;
+  }
+
+  const auto client_socket = new_socket();
+  const auto server_socket = new_socket();
+  const auto make_endpoint = [&](SOCKET peer) {
+    return Endpoint{
+      .peer = peer,
+      .config = default_config,
+      .inbox = {},
+      .is_peer_shutdown = false,
+      .send_free_at = clock,
+      .recv_script = {},
+      .send_script = {},
+    };
+  };
+  endpoints.insert({client_socket, make_endpoint(server_socket)});
+  endpoints.insert({server_socket, make_endpoint(client_socket)});
+  listeners.at(it->second).backlog.push_back(server_socket);
+
+  addr = loopback_addr(port_number);
+  return client_socket;
+}
+
+auto LoopbackTransport::start_connect(const std::string &ip, const std::string &port, SOCKADDR_IN &addr) -> SOCKET {
+  // connects right away, only a refused connect is left for select to report
+  const auto sock = connect(ip, port, addr);
+  if (sock != INVALID_SOCKET) {
+    return sock;
+  }
+
+  const auto refused_socket = new_socket();
+  refused.insert(refused_socket);
+  return refused_socket;
+}
+
+auto LoopbackTransport::finish_connect(SOCKET sock) -> int {
+  return endpoints.contains(sock) ? 0 : fail(WSAENOTSOCK);
+}
+
+auto LoopbackTransport::accept(SOCKET listen_socket, SOCKADDR_IN &addr) -> SOCKET {
+  auto it = listeners.find(listen_socket);
+  if (it == listeners.end()) {
+    fail(WSAENOTSOCK);
+    return INVALID_SOCKET;
+  }
+  if (it->second.backlog.empty()) {
+    fail(WSAEWOULDBLOCK);
+    return INVALID_SOCKET;
+  }
+
+  const auto sock = it->second.backlog.front();
+  it->second.backlog.pop_front();
+  addr = loopback_addr(0);
+  return sock;
+}
+
+auto LoopbackTransport::select(fd_set *read_set, fd_set *write_set, fd_set *err_set, timeval *timeout) -> int {
+  const auto is_known = [&](SOCKET sock) {
+    return endpoints.contains(sock) || listeners.contains(sock) || refused.contains(sock);
+  };
+  for (const auto *set : {read_set, write_set, err_set}) {
+    if (set != nullptr && !std::ranges::all_of(std::span{set->fd_array, set->fd_count}, is_known)) {
+      return fail(WSAENOTSOCK);
+    }
+  }
+
+  const auto is_read_ready = [&](SOCKET sock) {
+    if (auto it = listeners.find(sock); it != listeners.end()) {
+      return !it->second.backlog.empty();
+    }
+    return is_readable(endpoints.at(sock));
+  };
+  const auto is_write_ready = [&](SOCKET sock) { return endpoints.contains(sock); };
+  const auto is_err_ready = [&](SOCKET sock) { return refused.contains(sock); };
+  const auto count_ready = [](const fd_set *set, const auto &is_ready) {
+    return set == nullptr ? 0 : std::ranges::count_if(std::span{set->fd_array, set->fd_count}, is_ready);
+  };
+  const auto keep_ready = [](fd_set *set, const auto &is_ready) {
+    if (set == nullptr) {
+      return;
+    }
+    auto kept = u_int{0};
+    for (auto i = u_int{0}; i < set->fd_count; ++i) {
+      if (is_ready(set->fd_array[i])) {
+        set->fd_array[kept++] = set->fd_array[i];
+      }
+    }
+    set->fd_count = kept;
+  };
+
+  const auto wait_until = timeout == nullptr ? std::chrono::steady_clock::time_point::max()
+                                             : clock + std::chrono::seconds{timeout->tv_sec} +
+                                                 std::chrono::microseconds{timeout->tv_usec};
+  while (true) {
+    const auto ready = count_ready(read_set, is_read_ready) + count_ready(write_set, is_write_ready) +
+                       count_ready(err_set, is_err_ready);
+    if (ready > 0) {
+      keep_ready(read_set, is_read_ready);
+      keep_ready(write_set, is_write_ready);
+      keep_ready(err_set, is_err_ready);
+      return static_cast<int>(ready);
+    }
+
+    // nothing is ready, sleep until the next bytes arrive or the timeout
+    const auto arrival = next_arrival();
+    if (arrival > wait_until || arrival == std::chrono::steady_clock::time_point::max()) {
+      if (timeout != nullptr) {
+        clock = wait_until;
+      }
+      keep_ready(read_set, [](SOCKET) { return false; });
+      keep_ready(write_set, [](SOCKET) { return false; });
+      keep_ready(err_set, [](SOCKET) { return false; });
+      return 0;
+    }
+    clock = arrival;
+  }
+}
+
+auto LoopbackTransport::recv(SOCKET sock, char *buf, u_long len, u_long &received) -> int {
+  auto it = endpoints.find(sock);
+  if (it == endpoints.end()) {
+    return fail(WSAENOTSOCK);
+  }
+  auto &endpoint = it->second;
+
+  received = 0;
+  if (!endpoint.recv_script.empty()) {
+    const auto cap = endpoint.recv_script.front();
+    endpoint.recv_script.pop_front();
+    if (cap == 0) {
+      // a call that finds nothing to read, not the end of the stream
+      return fail(WSAEWOULDBLOCK);
+    }
+    len = std::min(len, cap);
+  }
+
+  while (received < len && !endpoint.inbox.empty() && endpoint.inbox.front().ready_at <= clock) {
+    auto &segment = endpoint.inbox.front();
+    const auto amount = std::min<size_t>(len - received, segment.bytes.size() - segment.offset);
+    std::memcpy(buf + received, segment.bytes.data() + segment.offset, amount);
+    received += static_cast<u_long>(amount);
+    segment.offset += amount;
+    if (segment.offset == segment.bytes.size()) {
+      endpoint.inbox.pop_front();
+    }
+  }
+
+  if (received == 0 && !is_readable(endpoint)) {
+    return fail(WSAEWOULDBLOCK);
+  }
+  // zero bytes here is the end of the stream
+  return 0;
+}
+
+auto LoopbackTransport::send(SOCKET sock, const char *buf, u_long len, u_long &sent) -> int {
+  auto it = endpoints.find(sock);
+  if (it == endpoints.end()) {
+    return fail(WSAENOTSOCK);
+  }
+  auto &endpoint = it->second;
+  if (endpoint.peer == INVALID_SOCKET) {
+    return fail(WSAECONNRESET);
+  }
+
+  if (!endpoint.send_script.empty()) {
+    len = std::min(len, endpoint.send_script.front());
+    endpoint.send_script.pop_front();
+  }
+
+  // bytes leave one after another at the link rate and arrive `latency` later
+  auto transfer_time = std::chrono::microseconds{0};
+  if (endpoint.config.bytes_per_sec > 0) {
+    transfer_time = std::chrono::microseconds{uint64_t{len} * 1'000'000 / endpoint.config.bytes_per_sec};
+  }
+  endpoint.send_free_at = std::max(endpoint.send_free_at, clock) + transfer_time;
+
+  endpoints.at(endpoint.peer)
+    .inbox.push_back(Segment{
+      .ready_at = endpoint.send_free_at + endpoint.config.latency,
+      .bytes = std::vector<char>{buf, buf + len},
+      .offset = 0,
+    });
+  sent = len;
+  return 0;
+}
+
+auto LoopbackTransport::shutdown(SOCKET sock) -> int {
+  auto it = endpoints.find(sock);
+  if (it == endpoints.end()) {
+    return fail(WSAENOTSOCK);
+  }
+  if (it->second.peer != INVALID_SOCKET) {
+    endpoints.at(it->second.peer).is_peer_shutdown = true;
+  }
+  return 0;
+}
+
+auto LoopbackTransport::close(SOCKET sock) -> int {
+  if (refused.erase(sock) > 0) {
+    return 0;
+  }
+  if (auto it = listeners.find(sock); it != listeners.end()) {
+    // connections that were never accepted are reset
+    for (const auto pending : it->second.backlog) {
+      close(pending);
+    }
+    ports.erase(it->second.port);
+    listeners.erase(it);
+    return 0;
+  }
+
+  auto it = endpoints.find(sock);
+  if (it == endpoints.end()) {
+    return fail(WSAENOTSOCK);
+  }
+  if (it->second.peer != INVALID_SOCKET) {
+    // the peer reads what is still queued and then the end of the stream
+    endpoints.at(it->second.peer).peer = INVALID_SOCKET;
+  }
+  endpoints.erase(it);
+  return 0;
+}
+
+auto LoopbackTransport::last_error() -> int {
+  return error;
+}
+
+auto LoopbackTransport::now() -> std::chrono::steady_clock::time_point {
+  return clock;
+}
+
+} // namespace winnet
@@ -0,0 +1,96 @@
+#pragma once
+
+#include <span>
+#include <deque>
+#include <chrono>
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <unordered_map>
+#include <unordered_set>
+
+#include "transport.hpp"
+
+namespace winnet {
+
+// in process transport where connected endpoints are paired through memory queues, for tests and benchmarks
+// there is no kernel and no real time: the clock only moves when advance() is called
+// or when select has nothing ready and waits out its timeout (or until the next delayed bytes arrive)
+// every endpoint is always writable, like a socket with a large send buffer
+class LoopbackTransport final : public Transport {
+public:
+  struct LinkConfig {
+    std::chrono::microseconds latency; // before sent bytes can be received
+    uint64_t bytes_per_sec;            // zero means unlimited
+  };
+
+private:
+  struct Segment {
+    std::chrono::steady_clock::time_point ready_at;
+    std::vector<char> bytes;
+    size_t offset;
+  };
+
+  struct Endpoint {
+    SOCKET peer; // INVALID_SOCKET once the peer is closed
+    LinkConfig config;
+    std::deque<Segment> inbox;
+    bool is_peer_shutdown;
+    // the link of this endpoint is busy sending until then
+    std::chrono::steady_clock::time_point send_free_at;
+    // caps of the next recv and send calls, scripted by the test
+    std::deque<u_long> recv_script;
+    std::deque<u_long> send_script;
+  };
+
+  struct Listener {
+    uint16_t port;
+    bool is_listening;
+    std::deque<SOCKET> backlog;
+  };
+
+  std::unordered_map<SOCKET, Endpoint> endpoints;
+  std::unordered_map<SOCKET, Listener> listeners;
+  std::unordered_map<uint16_t, SOCKET> ports;
+  // started connects that nobody listened for, select reports them in the error set until they are closed
+  std::unordered_set<SOCKET> refused;
+  LinkConfig default_config;
+  SOCKET next_socket;
+  uint16_t next_port;
+  int error;
+  std::chrono::steady_clock::time_point clock;
+
+  auto new_socket() -> SOCKET;
+  auto is_readable(const Endpoint &endpoint) const -> bool;
+  auto next_arrival() const -> std::chrono::steady_clock::time_point;
+  auto fail(int error_code) -> int;
+
+public:
+  LoopbackTransport();
+
+  // applied to connections made after the call, in both directions
+  auto set_link_config(LinkConfig config) -> void;
+  // the next recv (send) calls on `sock` move at most these many bytes each, one entry per call
+  // a zero recv entry makes that call fail with WSAEWOULDBLOCK
+  auto script_recv(SOCKET sock, std::vector<u_long> sizes) -> void;
+  auto script_send(SOCKET sock, std::vector<u_long> sizes) -> void;
+  // write raw bytes into the receive queue of `sock` as if its peer sent them, e.g. to fuzz the framing
+  auto inject(SOCKET sock, std::span<const char> bytes) -> void;
+  auto advance(std::chrono::microseconds duration) -> void;
+
+  auto bind(uint16_t port) -> SOCKET override;
+  auto listen(SOCKET sock) -> int override;
+  auto connect(const std::string &ip, const std::string &port, SOCKADDR_IN &addr) -> SOCKET override;
+  auto start_connect(const std::string &ip, const std::string &port, SOCKADDR_IN &addr) -> SOCKET override;
+  auto finish_connect(SOCKET sock) -> int override;
+  auto accept(SOCKET listen_socket, SOCKADDR_IN &addr) -> SOCKET override;
+  auto select(fd_set *read_set, fd_set *write_set, fd_set *err_set, timeval *timeout) -> int override;
+  auto recv(SOCKET sock, char *buf, u_long len, u_long &received) -> int override;
+  auto send(SOCKET sock, const char *buf, u_long len, u_long &sent) -> int override;
+  auto shutdown(SOCKET sock) -> int override;
+  auto close(SOCKET sock) -> int override;
+  auto last_error() -> int override;
+  auto now() -> std::chrono::steady_clock::time_point override;
+};
+
+} // namespace winnet
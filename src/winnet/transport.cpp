@@ -0,0 +1,183 @@
+#define WIN32_LEAN_AND_MEAN
+
+#include "transport.hpp"
+
+#include <bit>
+#include <thread>
+
+#include <ws2tcpip.h>
+
+#include <utils.hpp>
+#include <logger.hpp>
+
+namespace winnet {
+
+auto WinsockTransport::bind(uint16_t port) -> SOCKET {
+  // create a socket for the server to listen for client connections
+  const auto sock = ::WSASocketW(AF_INET, SOCK_STREAM, IPPROTO_TCP, nullptr, 0, WSA_FLAG_OVERLAPPED);
+  if (sock == INVALID_SOCKET) {
+    utils::print_wsa_error("[winsock error] socket creation failed");
+    return INVALID_SOCKET;
+  }
+
+  // bind
+  auto addr_hint = sockaddr_in{};
+  addr_hint.sin_family = AF_INET;
+  addr_hint.sin_addr.S_un.S_addr = ::htonl(INADDR_ANY); // INADDR_ANY == 0.0.0.0
+  addr_hint.sin_port = ::htons(port);                   // htonl, htons -> little endian에서 big endian으로 변환
+
+  if (::bind(sock, std::bit_cast<sockaddr *>(&addr_hint), sizeof(addr_hint)) == SOCKET_ERROR) {
+    utils::print_wsa_error("[winsock error] bind failed");
+    ::closesocket(sock);
+    return INVALID_SOCKET;
+  }
+
+  return sock;
+}
+
+auto WinsockTransport::listen(SOCKET sock) -> int {
+  return ::listen(sock, SOMAXCONN);
+}
+
+auto WinsockTransport::connect(const std::string &ip, const std::string &port, SOCKADDR_IN &addr) -> SOCKET {
+  // resolve the server address and port
+  auto addr_info = PADDRINFOA{};
+  auto addr_hints = addrinfo{};
+  addr_hints.ai_family = AF_UNSPEC;
+  addr_hints.ai_socktype = SOCK_STREAM;
+  addr_hints.ai_protocol = IPPROTO_TCP;
+
+  auto getaddr_result = ::getaddrinfo(ip.data(), port.data(), &addr_hints, &addr_info);
+  if (getaddr_result != 0) {
+    utils::log_error("[winsock error] getaddrinfo failed (error code: {})\n", getaddr_result);
+    return INVALID_SOCKET;
+  }
+  defer([&]() { ::freeaddrinfo(addr_info); });
+
+  // attempt to connect to an address until one succeeds
+  auto connect_socket = INVALID_SOCKET;
+  auto ptr = addr_info;
+  for (; ptr != nullptr; ptr = ptr->ai_next) {
+    // create a socket for connecting to server
+    connect_socket = ::WSASocketW(AF_INET, SOCK_STREAM, IPPROTO_TCP, nullptr, 0, WSA_FLAG_OVERLAPPED);
+    if (connect_socket == INVALID_SOCKET) {
+      utils::print_wsa_error("[winsock error] socket creation failed");
+      return INVALID_SOCKET;
+    }
+
+    // try connect
+    if (::WSAConnect(connect_socket, ptr->ai_addr, (int)ptr->ai_addrlen, nullptr, nullptr, nullptr, nullptr) ==
+        SOCKET_ERROR) {
+      ::closesocket(connect_socket);
+      connect_socket = INVALID_SOCKET;
+      continue;
+    }
+
+    addr = *(SOCKADDR_IN *)ptr->ai_addr;
+    break;
+  }
+
+  return connect_socket;
+}
+
+auto WinsockTransport::start_connect(const std::string &ip, const std::string &port, SOCKADDR_IN &addr) -> SOCKET {
+  // name resolution still blocks, it is quick for the addresses links are configured with
+  auto addr_info = PADDRINFOA{};
+  auto addr_hints = addrinfo{};
+  addr_hints.ai_family = AF_INET;
+  addr_hints.ai_socktype = SOCK_STREAM;
+  addr_hints.ai_protocol = IPPROTO_TCP;
+
+  auto getaddr_result = ::getaddrinfo(ip.data(), port.data(), &addr_hints, &addr_info);
+  if (getaddr_result != 0) {
+    utils::log_error("[winsock error] getaddrinfo failed (error code: {})\n", getaddr_result);
+    return INVALID_SOCKET;
+  }
+  defer([&]() { ::freeaddrinfo(addr_info); });
+
+  const auto sock = ::WSASocketW(AF_INET, SOCK_STREAM, IPPROTO_TCP, nullptr, 0, WSA_FLAG_OVERLAPPED);
+  if (sock == INVALID_SOCKET) {
+    utils::print_wsa_error("[winsock error] socket creation failed");
+    return INVALID_SOCKET;
+  }
+
+  auto mode = u_long{1};
+  if (::ioctlsocket(sock, FIONBIO, &mode) == SOCKET_ERROR) {
+    utils::print_wsa_error("[winsock error] ioctlsocket failed");
+    ::closesocket(sock);
+    return INVALID_SOCKET;
+  }
+
+  if (::WSAConnect(sock, addr_info->ai_addr, static_cast<int>(addr_info->ai_addrlen), nullptr, nullptr, nullptr,
+                   nullptr) == SOCKET_ERROR &&
+      ::WSAGetLastError() != WSAEWOULDBLOCK) {
+    ::closesocket(sock);
+    return INVALID_SOCKET;
+  }
+
+  addr = *std::bit_cast<SOCKADDR_IN *>(addr_info->ai_addr);
+  return sock;
+}
+
+auto WinsockTransport::finish_connect(SOCKET sock) -> int {
+  // back to blocking, the connection handler only reads and writes sockets that select reported
+  auto mode = u_long{0};
+  return ::ioctlsocket(sock, FIONBIO, &mode);
+}
+
+auto WinsockTransport::accept(SOCKET listen_socket, SOCKADDR_IN &addr) -> SOCKET {
+  auto addr_size = static_cast<int>(sizeof(addr));
+  return ::accept(listen_socket, std::bit_cast<sockaddr *>(&addr), &addr_size);
+}
+
+auto WinsockTransport::select(fd_set *read_set, fd_set *write_set, fd_set *err_set, timeval *timeout) -> int {
+  const auto is_empty = [](const fd_set *set) { return set == nullptr || set->fd_count == 0; };
+  if (is_empty(read_set) && is_empty(write_set) && is_empty(err_set)) {
+    // winsock fails without any socket (e.g. after everything was handed off), wait out the timeout instead
+    if (timeout != nullptr) {
+      std::this_thread::sleep_for(std::chrono::seconds{timeout->tv_sec} + std::chrono::microseconds{timeout->tv_usec});
+    }
+    return 0;
+  }
+  return ::select(0, read_set, write_set, err_set, timeout);
+}
+
+auto WinsockTransport::recv(SOCKET sock, char *buf, u_long len, u_long &received) -> int {
+  auto wsa_buf = WSABUF{
+    .len = len,
+    .buf = buf,
+  };
+  auto recv_flags = u_long{0};
+  return ::WSARecv(sock, &wsa_buf, 1ul, &received, &recv_flags, nullptr, nullptr);
+}
+
+auto WinsockTransport::send(SOCKET sock, const char *buf, u_long len, u_long &sent) -> int {
+  auto wsa_buf = WSABUF{
+    .len = len,
+    .buf = const_cast<char *>(buf),
+  };
+  return ::WSASend(sock, &wsa_buf, 1ul, &sent, 0, nullptr, nullptr);
+}
+
+auto WinsockTransport::shutdown(SOCKET sock) -> int {
+  return ::shutdown(sock, SD_SEND);
+}
+
+auto WinsockTransport::close(SOCKET sock) -> int {
+  return ::closesocket(sock);
+}
+
+auto WinsockTransport::last_error() -> int {
+  return ::WSAGetLastError();
+}
+
+auto WinsockTransport::now() -> std::chrono::steady_clock::time_point {
+  return std::chrono::steady_clock::now();
+}
+
+auto default_transport() -> Transport & {
+  static auto transport = WinsockTransport{};
+  return transport;
+}
+
+} // namespace winnet
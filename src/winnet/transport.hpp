@@ -0,0 +1,58 @@
+#pragma once
+
+#include <chrono>
+#include <string>
+#include <cstdint>
+
+#include <winsock2.h>
+
+namespace winnet {
+
+// the socket calls and the clock used by Server, Client and ConnectionHandler
+// the calls return like their winsock counterparts, last_error() replaces WSAGetLastError
+class Transport {
+public:
+  virtual ~Transport() = default;
+
+  // tcp socket bound to `port` on every interface, INVALID_SOCKET on failure
+  virtual auto bind(uint16_t port) -> SOCKET = 0;
+  virtual auto listen(SOCKET sock) -> int = 0;
+  // connected socket to the first address of `ip` that accepts, INVALID_SOCKET on failure
+  virtual auto connect(const std::string &ip, const std::string &port, SOCKADDR_IN &addr) -> SOCKET = 0;
+  // nonblocking connect to the first address of `ip`, the socket is reported by select in the write set
+  // once it is connected or in the error set when the connect failed, INVALID_SOCKET if it could not start
+  virtual auto start_connect(const std::string &ip, const std::string &port, SOCKADDR_IN &addr) -> SOCKET = 0;
+  // called once the socket from start_connect is writable, it blocks like the other sockets afterwards
+  virtual auto finish_connect(SOCKET sock) -> int = 0;
+  virtual auto accept(SOCKET listen_socket, SOCKADDR_IN &addr) -> SOCKET = 0;
+  // with every set empty it waits out `timeout` and returns 0 instead of failing
+  virtual auto select(fd_set *read_set, fd_set *write_set, fd_set *err_set, timeval *timeout) -> int = 0;
+  virtual auto recv(SOCKET sock, char *buf, u_long len, u_long &received) -> int = 0;
+  virtual auto send(SOCKET sock, const char *buf, u_long len, u_long &sent) -> int = 0;
+  virtual auto shutdown(SOCKET sock) -> int = 0;
+  virtual auto close(SOCKET sock) -> int = 0;
+  virtual auto last_error() -> int = 0;
+  virtual auto now() -> std::chrono::steady_clock::time_point = 0;
+};
+
+class WinsockTransport final : public Transport {
+public:
+  auto bind(uint16_t port) -> SOCKET override;
+  auto listen(SOCKET sock) -> int override;
+  auto connect(const std::string &ip, const std::string &port, SOCKADDR_IN &addr) -> SOCKET override;
+  auto start_connect(const std::string &ip, const std::string &port, SOCKADDR_IN &addr) -> SOCKET override;
+  auto finish_connect(SOCKET sock) -> int override;
+  auto accept(SOCKET listen_socket, SOCKADDR_IN &addr) -> SOCKET override;
+  auto select(fd_set *read_set, fd_set *write_set, fd_set *err_set, timeval *timeout) -> int override;
+  auto recv(SOCKET sock, char *buf, u_long len, u_long &received) -> int override;
+  auto send(SOCKET sock, const char *buf, u_long len, u_long &sent) -> int override;
+  auto shutdown(SOCKET sock) -> int override;
+  auto close(SOCKET sock) -> int override;
+  auto last_error() -> int override;
+  auto now() -> std::chrono::steady_clock::time_point override;
+};
+
+// shared winsock transport, what a NetEntity uses unless it is given another one
+auto default_transport() -> Transport &;
+
+} // namespace winnet
@@ -6,9 +6,12 @@
 #include <vector>
 #include <queue>
 #include <format>
+#include <random>
 #include <iostream>
+#include <string_view>
 
 #include <utils.hpp>
+#include <logger.hpp>
 
 namespace winnet {
 
@@ -33,85 +36,456 @@ auto wsa_deinit() -> bool {
   return true;
 }
 
-SendQueue::SendQueue() : mutex{}, queue{} {}
+namespace {
 
-SendQueue::SendQueue(SendQueue &old) : mutex{}, queue{old.queue} {}
+// packets that carry a message and may be batched
+auto is_message_packet(PacketType packet_type) -> bool {
+  return packet_type == PacketType::data || packet_type == PacketType::session_data ||
+         packet_type == PacketType::relay;
+}
+
+auto send_link_hello(Server *server, Connection &conn) -> void {
+  const auto parts = std::array{
+    std::span{std::bit_cast<const char *>(&server->node_id), sizeof(server->node_id)},
+    std::span<const char>{server->link_secret},
+  };
+  conn.send_packet(PacketType::link_hello, parts);
+}
 
-SendQueue::SendQueue(SendQueue &&old) noexcept : mutex{}, queue{std::move(old.queue)} {}
+// every byte is compared so the time taken does not tell how much of the secret was right
+auto is_link_secret(std::string_view secret, std::span<const char> given) -> bool {
+  if (secret.empty() || given.size() != secret.size()) {
+    return false;
+  }
+
+  auto diff = 0;
+  for (auto i = size_t{0}; i < secret.size(); ++i) {
+    diff |= secret[i] ^ given[i];
+  }
+  return diff == 0;
+}
+
+} // namespace
+
+auto make_packet(PacketType packet_type, const std::span<const std::span<const char>> parts, BufferPool *buffer_pool)
+  -> std::vector<char> {
+  auto body_size = size_t{0};
+  for (const auto &part : parts) {
+    body_size += part.size();
+  }
+
+  const auto header = PacketHeader{
+    .packet_size = static_cast<uint32_t>(body_size),
+    .packet_type = packet_type,
+  };
+  const auto header_size = sizeof(header);
+
+  auto packet = buffer_pool != nullptr ? buffer_pool->acquire(header_size + body_size)
+                                       : std::vector<char>(header_size + body_size);
+
+  std::memcpy(packet.data(), &header, header_size);
+  auto offset = header_size;
+  for (const auto &part : parts) {
+    std::memcpy(packet.data() + offset, part.data(), part.size());
+    offset += part.size();
+  }
+
+  return packet;
+}
+
+SendQueue::SendQueue() : mutex{}, lanes{}, lane_stats{}, credits{} {}
+
+SendQueue::SendQueue(SendQueue &old)
+    : mutex{}, lanes{old.lanes}, lane_stats{old.lane_stats}, credits{old.credits} {}
+
+SendQueue::SendQueue(SendQueue &&old) noexcept
+    : mutex{}, lanes{std::move(old.lanes)}, lane_stats{old.lane_stats}, credits{old.credits} {}
 
 auto SendQueue::is_empty() -> bool {
   const auto lock = std::scoped_lock{mutex};
-  return queue.empty();
+  return std::ranges::all_of(lanes, [](const auto &lane) { return lane.empty(); });
+}
+
+auto SendQueue::push_back(const std::vector<char> &data, SendLane lane) -> void {
+  push_back(std::vector<char>{data}, lane);
 }
 
-auto SendQueue::push_back(const std::vector<char> &data) -> void {
+auto SendQueue::push_back(std::vector<char> &&data, SendLane lane) -> void {
   const auto lock = std::scoped_lock{mutex};
-  queue.emplace(data);
+  const auto index = static_cast<size_t>(lane);
+  lanes[index].emplace(std::move(data));
+
+  auto &stats = lane_stats[index];
+  stats.depth = lanes[index].size();
+  stats.peak_depth = std::max(stats.peak_depth, stats.depth);
 }
 
-auto SendQueue::pop_front() -> std::vector<char> {
+auto SendQueue::pop_front(const SendSchedule &schedule) -> std::vector<char> {
   const auto lock = std::scoped_lock{mutex};
-  auto data = queue.front();
-  queue.pop();
+
+  auto index = size_t{0};
+  if (lanes[static_cast<size_t>(SendLane::control)].empty()) {
+    const auto pick = [&]() -> size_t {
+      for (auto i = size_t{1}; i < SEND_LANE_COUNT; ++i) {
+        if (!lanes[i].empty() && (schedule.is_strict || credits[i] > 0)) {
+          return i;
+        }
+      }
+      return SEND_LANE_COUNT;
+    };
+
+    index = pick();
+    if (index == SEND_LANE_COUNT) {
+      // every waiting lane used up its share, start a new round
+      for (auto i = size_t{1}; i < SEND_LANE_COUNT; ++i) {
+        credits[i] = std::max(schedule.weights[i], 1u);
+      }
+      index = pick();
+    }
+    if (!schedule.is_strict) {
+      credits[index] -= 1;
+    }
+  }
+
+  auto data = std::move(lanes[index].front());
+  lanes[index].pop();
+
+  auto &stats = lane_stats[index];
+  stats.depth = lanes[index].size();
+  stats.sent += 1;
   return data;
 }
 
+auto SendQueue::stats() -> std::array<SendLaneStats, SEND_LANE_COUNT> {
+  const auto lock = std::scoped_lock{mutex};
+  return lane_stats;
+}
+
+auto OffloadContext::get_recv_string() const -> std::string {
+  return std::string{data.begin(), data.end()};
+}
+
+auto OffloadContext::send(const std::span<const char> data) -> void {
+  handler->post([handler = handler, conn_id = conn_id, socket = socket,
+                 data_copy = std::vector<char>{data.begin(), data.end()}]() {
+    auto &connections = handler->net_entity->connections;
+    if (auto it = connections.find(socket); it != connections.end() && it->second.id == conn_id) {
+      it->second.send(data_copy);
+    }
+  });
+}
+
+auto OffloadContext::post(std::function<void()> task) -> void {
+  handler->post(std::move(task));
+}
+
+auto TokenBucket::refill(std::chrono::steady_clock::time_point now, double rate, double burst) -> void {
+  if (last_refill == std::chrono::steady_clock::time_point{}) {
+    // new bucket starts full
+    tokens = burst;
+  } else {
+    const auto elapsed = std::chrono::duration<double>(now - last_refill).count();
+    tokens = std::min(burst, tokens + elapsed * rate);
+  }
+  last_refill = now;
+}
+
+auto TokenBucket::wait_time(double rate) const -> std::chrono::microseconds {
+  if (rate <= 0 || tokens >= 1) {
+    return std::chrono::microseconds{0};
+  }
+
+  const auto wait = std::chrono::duration<double>((1 - tokens) / rate);
+  return std::chrono::ceil<std::chrono::microseconds>(wait);
+}
+
+auto Session::front_seq() const -> uint64_t {
+  return next_seq - retransmit.size();
+}
+
+auto Session::record(std::vector<char> packet) -> void {
+  next_seq += 1;
+  retransmit_bytes += packet.size();
+  retransmit.push_back(std::move(packet));
+
+  // drop the oldest packets, a client that missed them can not resume anymore
+  while (retransmit_bytes > retransmit_capacity && !retransmit.empty()) {
+    retransmit_bytes -= retransmit.front().size();
+    buffer_pool->release(std::move(retransmit.front()));
+    retransmit.pop_front();
+  }
+}
+
+auto Session::ack(uint64_t seq) -> void {
+  while (!retransmit.empty() && front_seq() <= seq) {
+    retransmit_bytes -= retransmit.front().size();
+    buffer_pool->release(std::move(retransmit.front()));
+    retransmit.pop_front();
+  }
+}
+
 Connection::Connection()
-    : socket{INVALID_SOCKET}, addr_info{}, recv_buf{}, recv_total_size{0}, cur_recv_amount{0}, is_recv_header(true),
-      send_queue{}, send_buf{}, cur_send_amount{0} {}
+    : id{next_id++}, socket{INVALID_SOCKET}, addr_info{}, session{nullptr}, stats{}, is_pinned{false}, is_link{false},
+      link_node_id{0}, link_target{}, is_connecting{false}, msg_bucket{}, byte_bucket{}, strand{}, buffer_pool{nullptr},
+      transport{&default_transport()}, peer_capabilities{0}, is_batching{false}, batch_buf{}, batch_count{0},
+      batch_started{}, recv_header{}, recv_buf{}, recv_data{}, recv_total_size{0}, cur_recv_amount{0},
+      is_recv_header(true), recv_packet_type{PacketType::data}, is_started{false}, send_queue{}, send_buf{},
+      cur_send_amount{0} {}
 
 Connection::Connection(SOCKET socket, SOCKADDR_IN addr_info)
-    : socket{socket}, addr_info{addr_info}, recv_buf{}, recv_total_size{0}, cur_recv_amount{0}, is_recv_header(true),
-      send_queue{}, send_buf{}, cur_send_amount{0} {
+    : id{next_id++}, socket{socket}, addr_info{addr_info}, session{nullptr}, stats{}, is_pinned{false}, is_link{false},
+      link_node_id{0}, link_target{}, is_connecting{false}, msg_bucket{}, byte_bucket{}, strand{}, buffer_pool{nullptr},
+      transport{&default_transport()}, peer_capabilities{0}, is_batching{false}, batch_buf{}, batch_count{0},
+      batch_started{}, recv_header{}, recv_buf{}, recv_data{}, recv_total_size{0}, cur_recv_amount{0},
+      is_recv_header(true), recv_packet_type{PacketType::data}, is_started{false}, send_queue{}, send_buf{},
+      cur_send_amount{0} {
   ip = std::string(INET_ADDRSTRLEN, '\0');
   ::inet_ntop(AF_INET, &addr_info.sin_addr, ip.data(), ip.length());
 }
 
 auto Connection::close() -> void {
-  if (::closesocket(this->socket) == SOCKET_ERROR) {
-    utils::print_wsa_error("[winsock error] closesocket failed");
+  if (transport->close(socket) == SOCKET_ERROR) {
+    utils::print_wsa_error("[winsock error] closesocket failed", transport->last_error());
   }
 }
 
-auto Connection::send(const std::span<const char> data) -> void {
+auto Connection::send(const std::span<const char> data, SendLane lane) -> void {
   if (data.empty()) {
     return;
   }
+  if (data.size() > ConnectionHandler::max_message_size()) {
+    // the peer would take the packet for a broken stream and drop the connection
+    utils::log_error("[send error] dropped a {} byte message, the limit is {}\n", data.size(),
+                     ConnectionHandler::max_message_size());
+    return;
+  }
 
+  if (session == nullptr || lane != SendLane::normal) {
+    // the client drops sequenced packets that arrive out of order, other lanes can overtake them
+    send_packet(PacketType::data, std::array{data}, lane);
+    return;
+  }
+
+  // number the packet so it can be replayed when the client resumes the session
+  const auto seq = session->next_seq;
+  const auto parts = std::array{
+    std::span{std::bit_cast<const char *>(&seq), sizeof(seq)},
+    data,
+  };
+  session->record(make_packet(PacketType::session_data, parts, buffer_pool));
+  send_packet(PacketType::session_data, parts);
+}
+
+auto Connection::send_packet(PacketType packet_type, const std::span<const std::span<const char>> parts) -> void {
+  send_packet(packet_type, parts, is_message_packet(packet_type) ? SendLane::normal : SendLane::control);
+}
+
+auto Connection::send_packet(PacketType packet_type, const std::span<const std::span<const char>> parts, SendLane lane)
+    -> void {
+  if (!is_batching || !is_message_packet(packet_type) || lane != SendLane::normal) {
+    if (lane == SendLane::normal) {
+      // keep the order of everything sent before
+      flush_batch();
+    }
+
+    // add to send queue
+    send_queue.push_back(make_packet(packet_type, parts, buffer_pool), lane);
+    return;
+  }
+
+  auto body_size = size_t{0};
+  for (const auto &part : parts) {
+    body_size += part.size();
+  }
   const auto header = PacketHeader{
-    .packet_size = static_cast<uint32_t>(data.size()),
+    .packet_size = static_cast<uint32_t>(body_size),
+    .packet_type = packet_type,
   };
-  const auto header_size = sizeof(header);
 
-  auto data_alloced = std::vector<char>{};
-  data_alloced.resize(header_size + data.size());
+  // most batches hold a few small messages, so start with room for the first one and grow by size class
+  // instead of pinning BATCH_MAX_SIZE per connection
+  const auto acquire = [this](size_t size) {
+    return buffer_pool != nullptr ? buffer_pool->acquire(size) : std::vector<char>(size);
+  };
+  if (batch_count > 0 && batch_buf.size() + sizeof(header) + body_size > ConnectionHandler::BATCH_MAX_SIZE) {
+    // the batch stays within BATCH_MAX_SIZE unless a single packet is larger on its own
+    flush_batch();
+  }
+  const auto used_size = batch_count == 0 ? sizeof(PacketHeader) : batch_buf.size();
+  const auto needed_size = used_size + sizeof(header) + body_size;
+  if (batch_count == 0) {
+    // leave room for the batch header
+    batch_buf = acquire(needed_size);
+    batch_buf.resize(used_size);
+  } else if (needed_size > batch_buf.capacity()) {
+    auto grown = acquire(std::max(needed_size, std::min(batch_buf.capacity() * 2, ConnectionHandler::BATCH_MAX_SIZE)));
+    std::memcpy(grown.data(), batch_buf.data(), used_size);
+    grown.resize(used_size);
+    if (buffer_pool != nullptr) {
+      buffer_pool->release(std::move(batch_buf));
+    }
+    batch_buf = std::move(grown);
+  }
 
-  std::memcpy(data_alloced.data(), &header, header_size);
-  std::memcpy(data_alloced.data() + header_size, data.data(), data.size());
+  auto offset = batch_buf.size();
+  batch_buf.resize(offset + sizeof(header) + body_size);
+  std::memcpy(batch_buf.data() + offset, &header, sizeof(header));
+  offset += sizeof(header);
+  for (const auto &part : parts) {
+    std::memcpy(batch_buf.data() + offset, part.data(), part.size());
+    offset += part.size();
+  }
+  batch_count += 1;
+
+  if (batch_buf.size() >= ConnectionHandler::BATCH_MAX_SIZE) {
+    flush_batch();
+  }
+}
+
+auto Connection::flush_batch() -> void {
+  if (batch_count == 0) {
+    return;
+  }
+
+  if (batch_count == 1) {
+    // a single packet does not need the batch header
+    batch_buf.erase(batch_buf.begin(), batch_buf.begin() + sizeof(PacketHeader));
+  } else {
+    const auto header = PacketHeader{
+      .packet_size = static_cast<uint32_t>(batch_buf.size() - sizeof(PacketHeader)),
+      .packet_type = PacketType::batch,
+    };
+    std::memcpy(batch_buf.data(), &header, sizeof(header));
+  }
+
+  // add to send queue
+  send_queue.push_back(std::move(batch_buf));
+  batch_buf = {};
+  batch_count = 0;
+  batch_started = {};
+}
+
+auto Connection::send_framed(const std::span<const std::span<const char>> segments, SendLane lane) -> void {
+  auto total_size = size_t{0};
+  for (const auto &segment : segments) {
+    total_size += segment.size();
+  }
+  if (total_size == 0) {
+    return;
+  }
+
+  auto data_alloced = buffer_pool != nullptr ? buffer_pool->acquire(total_size) : std::vector<char>(total_size);
+  auto offset = size_t{0};
+  for (const auto &segment : segments) {
+    std::memcpy(data_alloced.data() + offset, segment.data(), segment.size());
+    offset += segment.size();
+  }
 
   // add to send queue
-  send_queue.push_back(data_alloced);
+  if (lane == SendLane::normal) {
+    flush_batch();
+  }
+  send_queue.push_back(std::move(data_alloced), lane);
+}
+
+auto Connection::send_lane_stats() -> std::array<SendLaneStats, SEND_LANE_COUNT> {
+  return send_queue.stats();
 }
 
 auto Connection::get_recv_string() -> std::string {
-  return std::string{recv_buf.begin(), recv_buf.end()};
+  return std::string{recv_data.begin(), recv_data.end()};
 }
 
 auto Connection::get_recv_bytes() -> std::vector<char> {
-  return recv_buf;
+  return std::vector<char>{recv_data.begin(), recv_data.end()};
+}
+
+MessageHistory::MessageHistory(size_t capacity) : ring(capacity), head{0}, used{0}, count{0} {}
+
+auto MessageHistory::copy_in(size_t offset, const std::span<const char> data) -> void {
+  const auto first_len = std::min(data.size(), ring.size() - offset);
+  std::memcpy(ring.data() + offset, data.data(), first_len);
+  std::memcpy(ring.data(), data.data() + first_len, data.size() - first_len);
+}
+
+auto MessageHistory::copy_out(size_t offset, char *dst, size_t len) const -> void {
+  const auto first_len = std::min(len, ring.size() - offset);
+  std::memcpy(dst, ring.data() + offset, first_len);
+  std::memcpy(dst + first_len, ring.data(), len - first_len);
+}
+
+auto MessageHistory::capacity() const -> size_t {
+  return ring.size();
 }
 
-NetEntity::NetEntity() = default;
+auto MessageHistory::size() const -> size_t {
+  return count;
+}
+
+auto MessageHistory::size_bytes() const -> size_t {
+  return used;
+}
+
+auto MessageHistory::clear() -> void {
+  head = 0;
+  used = 0;
+  count = 0;
+}
+
+auto MessageHistory::push_back(const std::span<const char> data) -> bool {
+  const auto header = PacketHeader{
+    .packet_size = static_cast<uint32_t>(data.size()),
+    .packet_type = PacketType::data,
+  };
+  const auto header_size = sizeof(header);
+  const auto frame_size = header_size + data.size();
+  if (data.empty() || frame_size > ring.size()) {
+    return false;
+  }
+
+  // evict the oldest frames until the new one fits
+  while (ring.size() - used < frame_size) {
+    auto old_header = PacketHeader{};
+    copy_out(head, std::bit_cast<char *>(&old_header), header_size);
+    const auto old_frame_size = header_size + old_header.packet_size;
+    head = (head + old_frame_size) % ring.size();
+    used -= old_frame_size;
+    count -= 1;
+  }
+
+  const auto tail = (head + used) % ring.size();
+  copy_in(tail, std::span{std::bit_cast<const char *>(&header), header_size});
+  copy_in((tail + header_size) % ring.size(), data);
+  used += frame_size;
+  count += 1;
+  return true;
+}
+
+auto MessageHistory::snapshot() const -> std::array<std::span<const char>, 2> {
+  if (used == 0) {
+    return {};
+  }
+
+  const auto first_len = std::min(used, ring.size() - head);
+  return {
+    std::span{ring.data() + head, first_len},
+    std::span{ring.data(), used - first_len},
+  };
+}
+
+NetEntity::NetEntity() : transport{&default_transport()} {}
 
 NetEntity::~NetEntity() {
   for (auto &[sock, conn] : connections) {
-    ::closesocket(sock);
+    transport->close(sock);
   }
 }
 
 auto NetEntity::send_all(const std::span<const char> data) -> void {
   for (auto &[sock, conn] : connections) {
-    conn.send(data);
+    if (!conn.is_link) {
+      conn.send(data);
+    }
   }
 }
 
@@ -123,95 +497,166 @@ auto NetEntity::send_to(const std::span<SOCKET> targets, const std::span<const c
 
 auto NetEntity::send_all_but(const std::span<SOCKET> ignore_targets, const std::span<const char> data) -> void {
   for (auto &[sock, conn] : connections) {
-    if (std::find(ignore_targets.begin(), ignore_targets.end(), sock) == ignore_targets.end()) {
+    if (!conn.is_link && std::find(ignore_targets.begin(), ignore_targets.end(), sock) == ignore_targets.end()) {
       conn.send(data);
     }
   }
 }
 
-Server::Server() : listen_socket{INVALID_SOCKET}, port{0} {}
+Server::Server()
+    : listen_socket{INVALID_SOCKET}, port{0}, use_sessions{false}, session_retransmit_capacity{0}, session_expiry{0},
+      sessions{}, node_id{0}, next_relay_id{1}, relay_seen{}, relay_seen_order{}, link_targets{}, last_link_attempt{} {
+  auto random = std::random_device{};
+  while (node_id == 0) {
+    node_id = (uint64_t{random()} << 32) | uint64_t{random()};
+  }
+}
 
 Server::~Server() {
-  ::closesocket(listen_socket);
+  if (listen_socket != INVALID_SOCKET) {
+    transport->close(listen_socket);
+  }
 }
 
 auto Server::init(uint16_t port) -> bool {
-  // create a socket for the server to listen for client connections
-  listen_socket = ::WSASocketW(AF_INET, SOCK_STREAM, IPPROTO_TCP, nullptr, 0, WSA_FLAG_OVERLAPPED);
-  if (listen_socket == INVALID_SOCKET) {
-    utils::print_wsa_error("[winsock error] socket creation failed");
-    return false;
-  }
-
-  // bind
   this->port = port;
-  auto addr_hint = sockaddr_in{};
-  addr_hint.sin_family = AF_INET;
-  addr_hint.sin_addr.S_un.S_addr = ::htonl(INADDR_ANY); // INADDR_ANY == 0.0.0.0
-  addr_hint.sin_port = ::htons(port);                   // htonl, htons -> little endian에서 big endian으로 변환
+  listen_socket = transport->bind(port);
+  return listen_socket != INVALID_SOCKET;
+}
 
-  if (::bind(listen_socket, std::bit_cast<sockaddr *>(&addr_hint), sizeof(addr_hint)) == SOCKET_ERROR) {
-    utils::print_wsa_error("[winsock error] bind failed");
+auto Server::listen() -> bool {
+  if (transport->listen(listen_socket) == SOCKET_ERROR) {
+    utils::print_wsa_error("[winsock error] listen failed", transport->last_error());
     return false;
   }
 
   return true;
 }
 
-auto Server::listen() -> bool {
-  if (::listen(listen_socket, SOMAXCONN) == SOCKET_ERROR) {
-    utils::print_wsa_error("[winsock error] listen failed");
+auto Server::enable_sessions(size_t retransmit_capacity, std::chrono::seconds expiry) -> void {
+  use_sessions = true;
+  session_retransmit_capacity = retransmit_capacity;
+  session_expiry = expiry;
+}
+
+auto Server::create_session() -> Session & {
+  auto random = std::random_device{};
+  auto token = uint64_t{0};
+  while (token == 0 || sessions.contains(token)) {
+    token = (uint64_t{random()} << 32) | uint64_t{random()};
+  }
+
+  auto session = Session{
+    .token = token,
+    .socket = INVALID_SOCKET,
+    .username = {},
+    .next_seq = 1,
+    .retransmit = {},
+    .retransmit_bytes = 0,
+    .retransmit_capacity = session_retransmit_capacity,
+    .buffer_pool = &buffer_pool,
+    .detached_at = {},
+  };
+  return sessions.insert({token, std::move(session)}).first->second;
+}
+
+auto Server::add_link(const std::string &target) -> void {
+  link_targets.push_back(target);
+}
+
+auto Server::link(ConnectionHandler &connection_handler, const std::string &target) -> bool {
+  const auto colon = target.rfind(':');
+  if (colon == std::string::npos) {
+    utils::log_error("[link error] expected host:port, got {}\n", target);
     return false;
   }
 
+  auto addr = SOCKADDR_IN{};
+  const auto link_socket = transport->start_connect(target.substr(0, colon), target.substr(colon + 1), addr);
+  if (link_socket == INVALID_SOCKET) {
+    return false;
+  }
+
+  // select reports the socket writable once it is connected and in the error set when the connect failed
+  FD_SET(link_socket, &connection_handler.write_set);
+  FD_SET(link_socket, &connection_handler.err_set);
+
+  auto conn = Connection{link_socket, addr};
+  conn.buffer_pool = &buffer_pool;
+  conn.transport = transport;
+  conn.is_link = true;
+  conn.link_target = target;
+  conn.is_connecting = true;
+  auto &link_conn = connections.insert({link_socket, std::move(conn)}).first->second;
+
+  // queued until the connect finishes, relays to the other node are batched when both sides have batching on
+  link_conn.send_packet(PacketType::capabilities,
+                        std::array{
+                          std::span{std::bit_cast<const char *>(&LOCAL_CAPABILITIES), sizeof(LOCAL_CAPABILITIES)},
+                        });
+  send_link_hello(this, link_conn);
   return true;
 }
 
-Client::Client() = default;
+auto Server::publish(const std::span<const char> data) -> void {
+  publish_but({}, data);
+}
 
-Client::~Client() {
-  if (connection != nullptr) {
-    ::shutdown(connection->socket, SD_SEND);
+auto Server::publish_but(const std::span<SOCKET> ignore_targets, const std::span<const char> data) -> void {
+  if (data.size() > ConnectionHandler::max_message_size()) {
+    utils::log_error("[send error] dropped a {} byte broadcast, the limit is {}\n", data.size(),
+                     ConnectionHandler::max_message_size());
+    return;
   }
+
+  send_all_but(ignore_targets, data);
+
+  const auto header = RelayHeader{
+    .origin_node = node_id,
+    .msg_id = next_relay_id++,
+    .hops = 0,
+  };
+  relay(header, data, INVALID_SOCKET);
 }
 
-auto Client::connect(ConnectionHandler &connection_handler, std::string ip, std::string port) -> bool {
-  // resolve the server address and port
-  auto addr_info = PADDRINFOA{};
-  auto addr_hints = addrinfo{};
-  addr_hints.ai_family = AF_UNSPEC;
-  addr_hints.ai_socktype = SOCK_STREAM;
-  addr_hints.ai_protocol = IPPROTO_TCP;
-
-  auto getaddr_result = ::getaddrinfo(ip.data(), port.data(), &addr_hints, &addr_info);
-  if (getaddr_result != 0) {
-    std::cerr << std::format("[winsock error] getaddrinfo failed (error code: {})\n", getaddr_result);
+auto Server::relay(const RelayHeader &header, const std::span<const char> data, SOCKET from) -> void {
+  const auto parts = std::array{
+    std::span{std::bit_cast<const char *>(&header), sizeof(header)},
+    data,
+  };
+  for (auto &[sock, conn] : connections) {
+    if (conn.is_link && sock != from) {
+      conn.send_packet(PacketType::relay, parts);
+    }
+  }
+}
+
+auto Server::mark_relay_seen(uint64_t origin_node, uint64_t msg_id) -> bool {
+  if (!relay_seen.insert({origin_node, msg_id}).second) {
     return false;
   }
-  defer([&]() { ::freeaddrinfo(addr_info); });
 
-  // attempt to connect to an address until one succeeds
-  auto connect_socket = INVALID_SOCKET;
-  auto ptr = addr_info;
-  for (; ptr != nullptr; ptr = ptr->ai_next) {
-    // create a socket for connecting to server
-    connect_socket = ::WSASocketW(AF_INET, SOCK_STREAM, IPPROTO_TCP, nullptr, 0, WSA_FLAG_OVERLAPPED);
-    if (connect_socket == INVALID_SOCKET) {
-      utils::print_wsa_error("[winsock error] socket creation failed");
-      return false;
-    }
+  relay_seen_order.push_back({origin_node, msg_id});
+  if (relay_seen_order.size() > RELAY_DEDUP_CAPACITY) {
+    relay_seen.erase(relay_seen_order.front());
+    relay_seen_order.pop_front();
+  }
+  return true;
+}
 
-    // try connect
-    if (::WSAConnect(connect_socket, ptr->ai_addr, (int)ptr->ai_addrlen, nullptr, nullptr, nullptr, nullptr) ==
-        SOCKET_ERROR) {
-      ::closesocket(connect_socket);
-      connect_socket = INVALID_SOCKET;
-      continue;
-    }
+Client::Client()
+    : connection{nullptr}, use_sessions{false}, session_token{0}, session_recv_seq{0}, session_unacked{0},
+      last_session_ack{} {}
 
-    break;
+Client::~Client() {
+  if (connection != nullptr) {
+    transport->shutdown(connection->socket);
   }
+}
 
+auto Client::connect(ConnectionHandler &connection_handler, std::string ip, std::string port) -> bool {
+  auto addr = SOCKADDR_IN{};
+  const auto connect_socket = transport->connect(ip, port, addr);
   if (connect_socket == INVALID_SOCKET) {
     return false;
   }
@@ -219,9 +664,31 @@ auto Client::connect(ConnectionHandler &connection_handler, std::string ip, std:
   FD_SET(connect_socket, &connection_handler.read_set);
   FD_SET(connect_socket, &connection_handler.write_set);
 
-  auto conn = Connection{connect_socket, *(SOCKADDR_IN *)ptr->ai_addr};
+  auto conn = Connection{connect_socket, addr};
+  conn.buffer_pool = &buffer_pool;
+  conn.transport = transport;
   connections.insert({connect_socket, conn});
   connection = &connections.at(connect_socket);
+  connection->is_started = true;
+
+  connection->send_packet(PacketType::capabilities,
+                          std::array{
+                            std::span{std::bit_cast<const char *>(&LOCAL_CAPABILITIES), sizeof(LOCAL_CAPABILITIES)},
+                          });
+
+  if (use_sessions) {
+    if (session_token == 0) {
+      connection->send_packet(PacketType::session_hello, {});
+    } else {
+      connection->send_packet(PacketType::session_resume,
+                              std::array{
+                                std::span{std::bit_cast<const char *>(&session_token), sizeof(session_token)},
+                                std::span{std::bit_cast<const char *>(&session_recv_seq), sizeof(session_recv_seq)},
+                              });
+      session_unacked = 0;
+    }
+  }
+
   connection_handler.cb.on_conn_started(this, *connection);
   return true;
 }
@@ -233,16 +700,42 @@ auto Client::disconnect(ConnectionHandler &connection_handler) -> void {
 
   FD_ZERO(&connection_handler.read_set);
   FD_ZERO(&connection_handler.write_set);
-  connections.clear();
 
-  if (::shutdown(connection->socket, SD_SEND) == SOCKET_ERROR) {
-    utils::print_wsa_error("[winsock error] shutdown failed");
+  if (transport->shutdown(connection->socket) == SOCKET_ERROR) {
+    utils::print_wsa_error("[winsock error] shutdown failed", transport->last_error());
   }
 
   connection_handler.cb.on_conn_ended(this, *connection);
+  connections.clear();
+  connection = nullptr;
+}
+
+auto Client::enable_sessions() -> void {
+  use_sessions = true;
+}
+
+auto Client::send_session_ack() -> void {
+  if (connection == nullptr || session_token == 0) {
+    return;
+  }
+
+  connection->send_packet(PacketType::session_ack,
+                          std::array{
+                            std::span{std::bit_cast<const char *>(&session_recv_seq), sizeof(session_recv_seq)},
+                          });
+  session_unacked = 0;
+  last_session_ack = transport->now();
 }
 
-ConnectionHandler::ConnectionHandler(NetEntity *net_entity) : net_entity(net_entity), cb(net_entity->base_callbacks) {
+ConnectionHandler::ConnectionHandler(NetEntity *net_entity)
+    : net_entity(net_entity), cb(net_entity->base_callbacks), rate_limit{},
+      send_schedule{
+        .is_strict = false,
+        .weights = {0, 8, 4, 1},
+      },
+      use_batching{false},
+      batch_window{0}, posted_mutex{}, posted{}, offload_in_flight{0}, executor{}, last_session_sweep{},
+      next_batch_flush{} {
   FD_ZERO(&write_set);
   FD_ZERO(&read_set);
   FD_ZERO(&err_set);
@@ -263,18 +756,30 @@ ConnectionHandler::ConnectionHandler(NetEntity *net_entity) : net_entity(net_ent
     cb.on_conn_ended = [server](auto, Connection &conn) {
       server->cb.on_conn_ended(server, conn);
     };
+    cb.on_conn_throttled = [server](auto, Connection &conn) {
+      server->cb.on_conn_throttled(server, conn);
+    };
     cb.on_recv_error = [server](auto, Connection &conn, int err_code) {
       server->cb.on_recv_error(server, conn, err_code);
     };
     cb.on_recv_success = [server](auto, Connection &conn) {
       server->cb.on_recv_success(server, conn);
     };
+    cb.on_recv_offload = [server](auto, OffloadContext &ctx) {
+      server->cb.on_recv_offload(server, ctx);
+    };
+    cb.is_recv_pinned = [server](auto, Connection &conn) {
+      return server->cb.is_recv_pinned(server, conn);
+    };
     cb.on_send_error = [server](auto, Connection &conn, int err_code) {
       server->cb.on_send_error(server, conn, err_code);
     };
     cb.on_send_success = [server](auto, Connection &conn) {
       server->cb.on_send_success(server, conn);
     };
+    cb.on_relay = [server](auto, std::span<const char> data) {
+      server->cb.on_relay(server, data);
+    };
   }
 
   if (auto client = dynamic_cast<Client *>(net_entity)) {
@@ -293,18 +798,30 @@ ConnectionHandler::ConnectionHandler(NetEntity *net_entity) : net_entity(net_ent
     cb.on_conn_ended = [client](auto, Connection &conn) {
       client->cb.on_conn_ended(client, conn);
     };
+    cb.on_conn_throttled = [client](auto, Connection &conn) {
+      client->cb.on_conn_throttled(client, conn);
+    };
     cb.on_recv_error = [client](auto, Connection &conn, int err_code) {
       client->cb.on_recv_error(client, conn, err_code);
     };
     cb.on_recv_success = [client](auto, Connection &conn) {
       client->cb.on_recv_success(client, conn);
     };
+    cb.on_recv_offload = [client](auto, OffloadContext &ctx) {
+      client->cb.on_recv_offload(client, ctx);
+    };
+    cb.is_recv_pinned = [client](auto, Connection &conn) {
+      return client->cb.is_recv_pinned(client, conn);
+    };
     cb.on_send_error = [client](auto, Connection &conn, int err_code) {
       client->cb.on_send_error(client, conn, err_code);
     };
     cb.on_send_success = [client](auto, Connection &conn) {
       client->cb.on_send_success(client, conn);
     };
+    cb.on_relay = [client](auto, std::span<const char> data) {
+      client->cb.on_relay(client, data);
+    };
   }
 }
 
@@ -319,28 +836,75 @@ auto ConnectionHandler::is_full() -> bool {
 }
 
 auto ConnectionHandler::tick(timeval timeout) -> bool {
+  auto &transport = *net_entity->transport;
+  const auto now = transport.now();
+
+  run_posted();
+  if (executor != nullptr && offload_in_flight.load() > 0) {
+    // nothing wakes select up when a handler finishes, poll for its replies instead
+    const auto poll_timeout = timeval{
+      .tv_sec = 0,
+      .tv_usec = 1000,
+    };
+    if (timeout.tv_sec > 0 || timeout.tv_usec > poll_timeout.tv_usec) {
+      timeout = poll_timeout;
+    }
+  }
+
+  if (use_batching && next_batch_flush != std::chrono::steady_clock::time_point{}) {
+    // wake up in time to flush the pending batches
+    const auto wait = std::chrono::ceil<std::chrono::microseconds>(std::max(next_batch_flush - now, {}));
+    const auto timeout_wait = std::chrono::seconds{timeout.tv_sec} + std::chrono::microseconds{timeout.tv_usec};
+    if (wait < timeout_wait) {
+      timeout = timeval{
+        .tv_sec = static_cast<long>(wait.count() / 1'000'000),
+        .tv_usec = static_cast<long>(wait.count() % 1'000'000),
+      };
+    }
+  }
+
   // select function will remove unavalible sockets in from the set
   // we need to copy the set to keep sockets in the set
-  auto cur_read_set = read_set;
+  auto cur_read_set = is_rate_limited() ? throttle_read_set(now, timeout) : read_set;
   auto cur_write_set = write_set;
-  // auto cur_err_set = err_set;
+  auto cur_err_set = err_set;
 
-  const auto select_result = ::select(0, &cur_read_set, &cur_write_set, nullptr, &timeout);
+  const auto select_result = transport.select(&cur_read_set, &cur_write_set, &cur_err_set, &timeout);
 
   // check select error
   if (select_result == SOCKET_ERROR) {
-    const auto err_code = ::WSAGetLastError();
+    const auto err_code = transport.last_error();
     utils::print_wsa_error("[winsock error] select failed", err_code);
     cb.on_select_error(net_entity, *this, err_code);
     return false;
   }
 
+  if (auto server = dynamic_cast<Server *>(net_entity)) {
+    expire_sessions(server);
+    maintain_links(server);
+  }
+
+  if (auto client = dynamic_cast<Client *>(net_entity)) {
+    // select rarely times out while the socket is writable, so the idle ack goes by time instead
+    if (client->session_unacked > 0 && now - client->last_session_ack >= Client::SESSION_ACK_IDLE_TIME) {
+      client->send_session_ack();
+    }
+  }
+
   // check select timeout
   if (select_result == 0) {
     cb.on_select_timeout(net_entity, *this);
+    flush_batches();
     return true;
   }
 
+  // loop over cur_err_set, only links that are still connecting are in it
+  for (const auto sock : std::span{cur_err_set.fd_array, cur_err_set.fd_count}) {
+    if (auto it = net_entity->connections.find(sock); it != net_entity->connections.end()) {
+      drop_link_attempt(it->second);
+    }
+  }
+
   // loop over cur_read_set
   for (const auto sock : std::span{cur_read_set.fd_array, cur_read_set.fd_count}) {
     if (auto server = dynamic_cast<Server *>(net_entity)) {
@@ -351,21 +915,26 @@ auto ConnectionHandler::tick(timeval timeout) -> bool {
 
         // listen socket accept
         auto accept_info = sockaddr_in{};
-        auto accept_info_size = static_cast<int>(sizeof(accept_info));
-        auto accept_socket =
-          ::accept(server->listen_socket, std::bit_cast<sockaddr *>(&accept_info), &accept_info_size);
+        auto accept_socket = transport.accept(server->listen_socket, accept_info);
         if (accept_socket == INVALID_SOCKET) {
-          const int err_code = ::WSAGetLastError();
+          const int err_code = transport.last_error();
           utils::print_wsa_error("[winsock error] accept failed", err_code);
           cb.on_conn_accept_error(net_entity, err_code);
           continue;
         }
 
         auto conn = Connection{accept_socket, accept_info};
+        conn.buffer_pool = &net_entity->buffer_pool;
+        conn.transport = &transport;
         FD_SET(conn.socket, &read_set);
         FD_SET(conn.socket, &write_set);
         net_entity->connections.insert({conn.socket, conn});
-        cb.on_conn_started(net_entity, net_entity->connections.at(conn.socket));
+        if (!server->use_sessions) {
+          // with sessions the connection is started by session_hello
+          auto &new_conn = net_entity->connections.at(accept_socket);
+          new_conn.is_started = true;
+          cb.on_conn_started(net_entity, new_conn);
+        }
         continue;
       }
     }
@@ -382,64 +951,99 @@ auto ConnectionHandler::tick(timeval timeout) -> bool {
     if (conn.recv_total_size == 0) {
       // for packet header
       conn.is_recv_header = true;
-      const auto header_size = sizeof(uint32_t);
-      if (conn.recv_buf.size() < header_size) {
-        conn.recv_buf.resize(header_size);
-      }
-      conn.recv_total_size = header_size;
-    } else {
-      // for packet body
-      conn.is_recv_header = false;
-      if (conn.recv_buf.size() < conn.recv_total_size) {
-        conn.recv_buf.resize(conn.recv_total_size);
-      }
+      conn.recv_total_size = sizeof(PacketHeader);
+    } else if (!conn.is_recv_header && conn.recv_buf.empty()) {
+      // for packet body, it goes back to the pool once the packet is handled
+      conn.recv_buf = net_entity->buffer_pool.acquire(conn.recv_total_size);
     }
 
     // recv data
-    auto wsa_buf = WSABUF{
-      .len = conn.recv_total_size - conn.cur_recv_amount,
-      .buf = conn.recv_buf.data() + conn.cur_recv_amount,
-    };
+    auto recv_want = static_cast<u_long>(conn.recv_total_size - conn.cur_recv_amount);
+    if (rate_limit.recv_budget > 0) {
+      // one peer sending a large packet should not hog the tick
+      recv_want = std::min<u_long>(recv_want, rate_limit.recv_budget);
+    }
     auto recv_len = u_long{0};
-    auto recv_flags = u_long{0};
-    const auto recv_result = ::WSARecv(conn.socket, &wsa_buf, 1ul, &recv_len, &recv_flags, nullptr, nullptr);
+    const auto recv_result = transport.recv(
+      conn.socket, (conn.is_recv_header ? conn.recv_header.data() : conn.recv_buf.data()) + conn.cur_recv_amount,
+      recv_want, recv_len);
     if (recv_result == SOCKET_ERROR) {
-      const auto err_code = ::WSAGetLastError();
-      conn.close();
-      FD_CLR(conn.socket, &read_set);
-      FD_CLR(conn.socket, &write_set);
+      const auto err_code = transport.last_error();
+      if (err_code == WSAEWOULDBLOCK) {
+        // nothing to read after all, select reports the socket again
+        continue;
+      }
+      close_connection(conn);
       cb.on_recv_error(net_entity, conn, err_code);
-      cb.on_conn_ended(net_entity, conn);
-      net_entity->connections.erase(conn.socket);
+      end_connection(conn);
     } else {
       if (recv_len == 0) {
-        conn.close();
-        FD_CLR(conn.socket, &read_set);
-        FD_CLR(conn.socket, &write_set);
-        cb.on_conn_ended(net_entity, conn);
-        net_entity->connections.erase(conn.socket);
+        close_connection(conn);
+        end_connection(conn);
       } else {
         conn.cur_recv_amount += recv_len;
+        conn.stats.recv_bytes += recv_len;
+        if (is_rate_limited() && !conn.is_link) {
+          refill_buckets(conn, now);
+          conn.byte_bucket.tokens -= recv_len;
+        }
         // std::cout << "[reciving] " << (conn.is_recv_header ? "header" : "body")
         //           << std::format(" -> progress: {}/{}\n", conn.cur_recv_amount, conn.recv_total_size);
 
         if (conn.cur_recv_amount == conn.recv_total_size) {
           if (conn.is_recv_header) {
-            conn.recv_total_size = *std::bit_cast<uint32_t *>(conn.recv_buf.data());
+            const auto header = *std::bit_cast<PacketHeader *>(conn.recv_header.data());
+            if (header.packet_size > MAX_PACKET_SIZE) {
+              // a broken stream or a hostile peer
+              close_connection(conn);
+              cb.on_recv_error(net_entity, conn, WSAEMSGSIZE);
+              end_connection(conn);
+              continue;
+            }
+            conn.recv_total_size = header.packet_size;
+            conn.recv_packet_type = header.packet_type;
             conn.is_recv_header = false;
+            if (conn.recv_total_size == 0) {
+              // packet without a body
+              handle_packet(conn, {});
+              conn.is_recv_header = true;
+            }
           } else {
             // on packet body recv finish
-            cb.on_recv_success(net_entity, conn);
+            handle_packet(conn, std::span{conn.recv_buf.data(), conn.recv_total_size});
+            net_entity->buffer_pool.release(std::move(conn.recv_buf));
+            conn.recv_buf = {};
             conn.recv_total_size = 0;
             conn.is_recv_header = true;
           }
-          conn.recv_buf.clear();
           conn.cur_recv_amount = 0;
         }
+
+        if (is_rate_limited() && !conn.is_link && rate_limit.action == RateLimitAction::drop) {
+          // an empty bucket only means the next message has to wait, the limit is broken once it is overdrawn
+          if (is_overdrawn(conn)) {
+            if (auto server = dynamic_cast<Server *>(net_entity); server != nullptr && conn.session != nullptr) {
+              // end the session too, or the client could resume it right away
+              end_session(server, *conn.session);
+            } else {
+              close_connection(conn);
+              end_connection(conn);
+            }
+            continue;
+          }
+        } else if (is_rate_limited() && !conn.is_link && throttle_wait_time(conn) > std::chrono::microseconds{0}) {
+          if (!conn.stats.is_throttled) {
+            conn.stats.is_throttled = true;
+            conn.stats.throttle_count += 1;
+            cb.on_conn_throttled(net_entity, conn);
+          }
+        }
       }
     }
   }
 
+  flush_batches();
+
   // loop over cur_write_set
   for (const auto sock : std::span{cur_write_set.fd_array, cur_write_set.fd_count}) {
     if (auto server = dynamic_cast<Server *>(net_entity)) {
@@ -457,35 +1061,46 @@ auto ConnectionHandler::tick(timeval timeout) -> bool {
     // handle connections
     auto &conn = net_entity->connections.at(sock);
 
+    if (conn.is_connecting) {
+      if (transport.finish_connect(conn.socket) == SOCKET_ERROR) {
+        drop_link_attempt(conn);
+        continue;
+      }
+      conn.is_connecting = false;
+      FD_CLR(conn.socket, &err_set);
+      FD_SET(conn.socket, &read_set);
+    }
+
     // send data
     if (!conn.send_queue.is_empty()) {
       if (conn.send_buf.empty()) {
-        conn.send_buf = conn.send_queue.pop_front();
+        conn.send_buf = conn.send_queue.pop_front(send_schedule);
       }
 
       if (conn.cur_send_amount < conn.send_buf.size()) {
-        auto wsa_buf = WSABUF{
-          .len = static_cast<u_long>(conn.send_buf.size() - conn.cur_send_amount),
-          .buf = conn.send_buf.data() + conn.cur_send_amount,
-        };
         auto send_len = u_long{0};
-        const auto send_result = ::WSASend(conn.socket, &wsa_buf, 1ul, &send_len, 0, nullptr, nullptr);
+        const auto send_result =
+          transport.send(conn.socket, conn.send_buf.data() + conn.cur_send_amount,
+                         static_cast<u_long>(conn.send_buf.size() - conn.cur_send_amount), send_len);
         if (send_result == SOCKET_ERROR) {
-          const auto err_code = ::WSAGetLastError();
-          conn.close();
-          FD_CLR(conn.socket, &read_set);
-          FD_CLR(conn.socket, &write_set);
+          const auto err_code = transport.last_error();
+          close_connection(conn);
           cb.on_send_error(net_entity, conn, err_code);
-          cb.on_conn_ended(net_entity, conn);
-          net_entity->connections.erase(conn.socket);
+          end_connection(conn);
         } else {
           conn.cur_send_amount += send_len;
           // std::cout << std::format("[sending] -> progress: {}/{}\n", send_result, conn.send_buf.size());
 
           if (conn.cur_send_amount == conn.send_buf.size()) {
+            if (capture.is_open()) {
+              // the buffer can hold several packets when it was queued with send_framed
+              capture_sent(conn, conn.send_buf, true);
+            }
+
             // packet recive finish
             cb.on_send_success(net_entity, conn);
-            conn.send_buf.clear();
+            net_entity->buffer_pool.release(std::move(conn.send_buf));
+            conn.send_buf = {};
             conn.cur_send_amount = 0;
           }
         }
@@ -496,6 +1111,603 @@ auto ConnectionHandler::tick(timeval timeout) -> bool {
   return true;
 }
 
+auto ConnectionHandler::enable_capture(const std::string &path) -> bool {
+  return capture.open(path, CAPTURE_INITIAL_SIZE);
+}
+
+auto ConnectionHandler::disable_capture() -> void {
+  capture.close();
+}
+
+auto ConnectionHandler::is_rate_limited() const -> bool {
+  return rate_limit.msgs_per_sec > 0 || rate_limit.bytes_per_sec > 0;
+}
+
+auto ConnectionHandler::capture_sent(Connection &conn, std::span<const char> packets, bool is_outer) -> void {
+  auto offset = size_t{0};
+  while (packets.size() - offset >= sizeof(PacketHeader)) {
+    const auto header = *std::bit_cast<const PacketHeader *>(packets.data() + offset);
+    offset += sizeof(PacketHeader);
+    if (header.packet_size > packets.size() - offset) {
+      break;
+    }
+    const auto body = packets.subspan(offset, header.packet_size);
+    if (header.packet_type == PacketType::batch && is_outer) {
+      // record the inner packets like the receiving side does
+      capture_sent(conn, body, false);
+    } else {
+      capture.append(conn.id, CaptureDirection::send, static_cast<uint8_t>(header.packet_type), body);
+    }
+    offset += header.packet_size;
+  }
+}
+
+auto ConnectionHandler::handle_packet(Connection &conn, std::span<const char> body) -> void {
+  if (conn.recv_packet_type == PacketType::batch) {
+    // every inner packet is handled (and counted) on its own
+    auto offset = size_t{0};
+    while (body.size() - offset >= sizeof(PacketHeader)) {
+      const auto header = *std::bit_cast<const PacketHeader *>(body.data() + offset);
+      offset += sizeof(PacketHeader);
+      if (header.packet_size > body.size() - offset || header.packet_type == PacketType::batch) {
+        break;
+      }
+      conn.recv_packet_type = header.packet_type;
+      handle_packet(conn, body.subspan(offset, header.packet_size));
+      offset += header.packet_size;
+    }
+    conn.recv_packet_type = PacketType::batch;
+    return;
+  }
+
+  if (capture.is_open()) {
+    capture.append(conn.id, CaptureDirection::recv, static_cast<uint8_t>(conn.recv_packet_type), body);
+  }
+
+  conn.stats.recv_packets += 1;
+  if (rate_limit.msgs_per_sec > 0 && !conn.is_link) {
+    conn.msg_bucket.tokens -= 1;
+  }
+
+  switch (conn.recv_packet_type) {
+  case PacketType::data:
+    if (conn.is_link) {
+      // links only carry relays
+      break;
+    }
+    if (dynamic_cast<Server *>(net_entity) != nullptr && body.size() > max_message_size()) {
+      // it could not be passed on, a session or relay header would push it past MAX_PACKET_SIZE
+      utils::log_error("[recv error] dropped a {} byte message from {}, the limit is {}\n", body.size(), conn.ip,
+                       max_message_size());
+      break;
+    }
+    if (!conn.is_started) {
+      // the peer does not use sessions
+      conn.is_started = true;
+      cb.on_conn_started(net_entity, conn);
+    }
+    conn.recv_data = body;
+    dispatch_recv(conn);
+    break;
+
+  case PacketType::session_data: {
+    auto seq = uint64_t{0};
+    if (body.size() < sizeof(seq)) {
+      break;
+    }
+    std::memcpy(&seq, body.data(), sizeof(seq));
+
+    if (auto client = dynamic_cast<Client *>(net_entity)) {
+      if (seq <= client->session_recv_seq) {
+        // already got this one before reconnecting
+        break;
+      }
+      client->session_recv_seq = seq;
+      client->session_unacked += 1;
+      if (client->session_unacked >= Client::SESSION_ACK_INTERVAL) {
+        client->send_session_ack();
+      }
+    }
+
+    conn.recv_data = body.subspan(sizeof(seq));
+    dispatch_recv(conn);
+    break;
+  }
+
+  case PacketType::capabilities: {
+    auto flags = uint32_t{0};
+    if (body.size() < sizeof(flags)) {
+      break;
+    }
+    std::memcpy(&flags, body.data(), sizeof(flags));
+
+    conn.peer_capabilities = flags;
+    conn.is_batching = use_batching && (flags & CAPABILITY_BATCH) != 0;
+    if (dynamic_cast<Server *>(net_entity) != nullptr && conn.link_target.empty()) {
+      // answer with ours, old clients never ask and the side that dialed a link asked first
+      conn.send_packet(PacketType::capabilities,
+                       std::array{
+                         std::span{std::bit_cast<const char *>(&LOCAL_CAPABILITIES), sizeof(LOCAL_CAPABILITIES)},
+                       });
+    }
+    break;
+  }
+
+  case PacketType::link_hello: {
+    auto server = dynamic_cast<Server *>(net_entity);
+    auto node_id = uint64_t{0};
+    if (server == nullptr || body.size() < sizeof(node_id)) {
+      break;
+    }
+    std::memcpy(&node_id, body.data(), sizeof(node_id));
+
+    // a link we dialed is the server we were told to reach, anyone else has to know the secret
+    if (conn.link_target.empty() && !is_link_secret(server->link_secret, body.subspan(sizeof(node_id)))) {
+      utils::log_error("[link error] refused link_hello from {}\n", conn.ip);
+      // the caller still uses the connection, close it on the next tick and read nothing more until then
+      FD_CLR(conn.socket, &read_set);
+      post([this, sock = conn.socket, conn_id = conn.id]() {
+        auto &connections = net_entity->connections;
+        if (auto it = connections.find(sock); it != connections.end() && it->second.id == conn_id) {
+          close_connection(it->second);
+          end_connection(it->second);
+        }
+      });
+      break;
+    }
+
+    conn.is_link = true;
+    conn.link_node_id = node_id;
+    if (conn.link_target.empty()) {
+      send_link_hello(server, conn);
+    }
+    utils::log_info("linked to node {:X} ({})\n", node_id, conn.ip);
+    break;
+  }
+
+  case PacketType::relay:
+    if (auto server = dynamic_cast<Server *>(net_entity); server != nullptr && conn.is_link) {
+      handle_relay(server, conn, body);
+    }
+    break;
+
+  case PacketType::session_token: {
+    auto token = uint64_t{0};
+    auto resumed = uint8_t{0};
+    if (body.size() < sizeof(token) + sizeof(resumed)) {
+      break;
+    }
+    std::memcpy(&token, body.data(), sizeof(token));
+    std::memcpy(&resumed, body.data() + sizeof(token), sizeof(resumed));
+
+    if (auto client = dynamic_cast<Client *>(net_entity)) {
+      if (resumed == 0) {
+        // new session, sequence numbers start over
+        client->session_recv_seq = 0;
+      }
+      client->session_token = token;
+      client->session_unacked = 0;
+    }
+    break;
+  }
+
+  default:
+    if (auto server = dynamic_cast<Server *>(net_entity)) {
+      handle_session_packet(server, conn, body);
+    }
+    break;
+  }
+}
+
+auto ConnectionHandler::dispatch_recv(Connection &conn) -> void {
+  if (executor == nullptr) {
+    cb.on_recv_success(net_entity, conn);
+    return;
+  }
+
+  if (conn.strand == nullptr) {
+    conn.strand = std::make_shared<Strand>();
+  }
+
+  const auto is_pinned = conn.is_pinned || cb.is_recv_pinned(net_entity, conn);
+  if (is_pinned) {
+    // only this thread schedules the strand, so it stays idle until the handler returns
+    auto is_idle = false;
+    {
+      const auto lock = std::scoped_lock{conn.strand->mutex};
+      is_idle = !conn.strand->is_scheduled;
+    }
+    if (is_idle) {
+      cb.on_recv_success(net_entity, conn);
+      return;
+    }
+  }
+
+  auto ctx = OffloadContext{
+    .conn_id = conn.id,
+    .socket = conn.socket,
+    .username = conn.username,
+    .data = std::vector<char>{conn.recv_data.begin(), conn.recv_data.end()},
+    .handler = this,
+    .is_pinned = is_pinned,
+  };
+  offload_in_flight.fetch_add(1);
+
+  const auto lock = std::scoped_lock{conn.strand->mutex};
+  conn.strand->queue.push_back(std::move(ctx));
+  if (!conn.strand->is_scheduled) {
+    // one task per connection at a time keeps its messages in order
+    conn.strand->is_scheduled = true;
+    executor->submit([this, strand = conn.strand]() { run_strand(strand); });
+  }
+}
+
+auto ConnectionHandler::run_strand(const std::shared_ptr<Strand> &strand) -> void {
+  while (true) {
+    auto ctx = OffloadContext{};
+    {
+      const auto lock = std::scoped_lock{strand->mutex};
+      if (strand->queue.empty()) {
+        strand->is_scheduled = false;
+        return;
+      }
+      ctx = std::move(strand->queue.front());
+      strand->queue.pop_front();
+    }
+
+    if (ctx.is_pinned) {
+      // the strand stays scheduled until the io thread has run it
+      post([this, strand, ctx = std::move(ctx)]() mutable { run_pinned(strand, ctx); });
+      return;
+    }
+
+    cb.on_recv_offload(net_entity, ctx);
+    offload_in_flight.fetch_sub(1);
+  }
+}
+
+auto ConnectionHandler::run_pinned(const std::shared_ptr<Strand> &strand, OffloadContext &ctx) -> void {
+  auto &connections = net_entity->connections;
+  if (auto it = connections.find(ctx.socket); it != connections.end() && it->second.id == ctx.conn_id) {
+    auto &conn = it->second;
+    conn.recv_data = ctx.data;
+    cb.on_recv_success(net_entity, conn);
+  }
+  offload_in_flight.fetch_sub(1);
+
+  // continue with the messages that arrived after it
+  const auto lock = std::scoped_lock{strand->mutex};
+  if (strand->queue.empty()) {
+    strand->is_scheduled = false;
+  } else {
+    executor->submit([this, strand]() { run_strand(strand); });
+  }
+}
+
+auto ConnectionHandler::run_posted() -> void {
+  auto tasks = std::vector<std::function<void()>>{};
+  {
+    const auto lock = std::scoped_lock{posted_mutex};
+    tasks.swap(posted);
+  }
+
+  for (auto &task : tasks) {
+    task();
+  }
+}
+
+auto ConnectionHandler::enable_executor(size_t thread_count) -> void {
+  executor = std::make_unique<Executor>(thread_count);
+}
+
+auto ConnectionHandler::post(std::function<void()> task) -> void {
+  const auto lock = std::scoped_lock{posted_mutex};
+  posted.push_back(std::move(task));
+}
+
+auto ConnectionHandler::max_message_size() -> size_t {
+  // the relay header is the larger of the two wrappers
+  return MAX_PACKET_SIZE - sizeof(RelayHeader);
+}
+
+auto ConnectionHandler::enable_batching(std::chrono::microseconds window) -> void {
+  use_batching = true;
+  batch_window = window;
+}
+
+auto ConnectionHandler::flush_batches() -> void {
+  if (!use_batching) {
+    return;
+  }
+
+  const auto now = net_entity->transport->now();
+  next_batch_flush = {};
+  for (auto &[sock, conn] : net_entity->connections) {
+    if (conn.batch_count == 0) {
+      continue;
+    }
+
+    if (conn.batch_started == std::chrono::steady_clock::time_point{}) {
+      // stamped here instead of in send_packet, which has no clock
+      conn.batch_started = now;
+    }
+    const auto deadline = conn.batch_started + batch_window;
+    if (deadline <= now) {
+      conn.flush_batch();
+    } else if (next_batch_flush == std::chrono::steady_clock::time_point{} || deadline < next_batch_flush) {
+      next_batch_flush = deadline;
+    }
+  }
+}
+
+auto ConnectionHandler::handle_session_packet(Server *server, Connection &conn, std::span<const char> body) -> void {
+  if (!server->use_sessions) {
+    return;
+  }
+
+  const auto send_token = [&conn](uint64_t token, uint8_t resumed) {
+    conn.send_packet(PacketType::session_token, std::array{
+                                                  std::span{std::bit_cast<const char *>(&token), sizeof(token)},
+                                                  std::span{std::bit_cast<const char *>(&resumed), sizeof(resumed)},
+                                                });
+  };
+
+  const auto start_new_session = [&]() {
+    auto &session = server->create_session();
+    attach_session(conn, session);
+    send_token(session.token, 0);
+    conn.is_started = true;
+    cb.on_conn_started(net_entity, conn);
+  };
+
+  switch (conn.recv_packet_type) {
+  case PacketType::session_hello:
+    if (conn.session == nullptr && !conn.is_started) {
+      start_new_session();
+    }
+    break;
+
+  case PacketType::session_resume: {
+    if (conn.session != nullptr || conn.is_started) {
+      break;
+    }
+
+    auto token = uint64_t{0};
+    auto last_seq = uint64_t{0};
+    if (body.size() < sizeof(token) + sizeof(last_seq)) {
+      break;
+    }
+    std::memcpy(&token, body.data(), sizeof(token));
+    std::memcpy(&last_seq, body.data() + sizeof(token), sizeof(last_seq));
+
+    auto it = server->sessions.find(token);
+    if (it == server->sessions.end()) {
+      start_new_session();
+      break;
+    }
+
+    auto &session = it->second;
+    if (last_seq >= session.next_seq || last_seq + 1 < session.front_seq()) {
+      // the missed packets are not buffered anymore, start over
+      end_session(server, session);
+      start_new_session();
+      break;
+    }
+
+    if (session.socket != INVALID_SOCKET && server->connections.contains(session.socket)) {
+      // the old connection is half open, detach it (keeping its name in the session) and drop it
+      auto &old_conn = server->connections.at(session.socket);
+      close_connection(old_conn);
+      end_connection(old_conn);
+    }
+
+    session.ack(last_seq);
+    attach_session(conn, session);
+    send_token(session.token, 1);
+    conn.is_started = true;
+
+    // replay the gap with a single send
+    auto segments = std::vector<std::span<const char>>{};
+    segments.reserve(session.retransmit.size());
+    for (const auto &packet : session.retransmit) {
+      segments.emplace_back(packet);
+    }
+    conn.send_framed(segments);
+    break;
+  }
+
+  case PacketType::session_ack: {
+    auto seq = uint64_t{0};
+    if (conn.session == nullptr || body.size() < sizeof(seq)) {
+      break;
+    }
+    std::memcpy(&seq, body.data(), sizeof(seq));
+    conn.session->ack(seq);
+    break;
+  }
+
+  default:
+    break;
+  }
+}
+
+auto ConnectionHandler::attach_session(Connection &conn, Session &session) -> void {
+  conn.session = &session;
+  if (!session.username.empty()) {
+    conn.username = session.username;
+  }
+  session.socket = conn.socket;
+}
+
+auto ConnectionHandler::end_session(Server *server, Session &session) -> void {
+  if (session.socket != INVALID_SOCKET && server->connections.contains(session.socket)) {
+    auto &conn = server->connections.at(session.socket);
+    conn.session = nullptr;
+    close_connection(conn);
+    end_connection(conn);
+  } else {
+    // the connection is already gone, report the end of the session instead
+    auto conn = Connection{};
+    conn.username = session.username;
+    conn.is_started = true;
+    cb.on_conn_ended(net_entity, conn);
+  }
+
+  server->sessions.erase(session.token);
+}
+
+auto ConnectionHandler::handle_relay(Server *server, Connection &conn, std::span<const char> body) -> void {
+  auto header = RelayHeader{};
+  if (body.size() < sizeof(header)) {
+    return;
+  }
+  std::memcpy(&header, body.data(), sizeof(header));
+  const auto data = body.subspan(sizeof(header));
+
+  if (header.origin_node == server->node_id || !server->mark_relay_seen(header.origin_node, header.msg_id)) {
+    // came back around a loop or over a second path
+    return;
+  }
+
+  server->send_all(data);
+  cb.on_relay(net_entity, data);
+
+  header.hops += 1;
+  if (header.hops < Server::RELAY_MAX_HOPS) {
+    server->relay(header, data, conn.socket);
+  }
+}
+
+auto ConnectionHandler::maintain_links(Server *server) -> void {
+  if (server->link_targets.empty()) {
+    return;
+  }
+
+  const auto now = net_entity->transport->now();
+  if (now - server->last_link_attempt < Server::LINK_RETRY_INTERVAL) {
+    return;
+  }
+  server->last_link_attempt = now;
+
+  for (const auto &target : server->link_targets) {
+    // a link that is still connecting counts, it is dropped here again if the connect fails
+    const auto is_linked = std::ranges::any_of(
+      server->connections, [&](const auto &entry) { return entry.second.link_target == target; });
+    if (!is_linked && !is_full() && !server->link(*this, target)) {
+      utils::log_error("[link error] could not reach {}, retrying in {}s\n", target,
+                       Server::LINK_RETRY_INTERVAL.count());
+    }
+  }
+}
+
+auto ConnectionHandler::drop_link_attempt(Connection &conn) -> void {
+  utils::log_error("[link error] could not reach {}, retrying in {}s\n", conn.link_target,
+                   Server::LINK_RETRY_INTERVAL.count());
+  close_connection(conn);
+  end_connection(conn);
+}
+
+auto ConnectionHandler::expire_sessions(Server *server) -> void {
+  if (!server->use_sessions) {
+    return;
+  }
+
+  const auto now = net_entity->transport->now();
+  if (now - last_session_sweep < std::chrono::seconds{1}) {
+    return;
+  }
+  last_session_sweep = now;
+
+  auto expired = std::vector<uint64_t>{};
+  for (const auto &[token, session] : server->sessions) {
+    if (session.socket == INVALID_SOCKET && now - session.detached_at >= server->session_expiry) {
+      expired.push_back(token);
+    }
+  }
+  for (const auto token : expired) {
+    end_session(server, server->sessions.at(token));
+  }
+}
+
+auto ConnectionHandler::throttle_read_set(std::chrono::steady_clock::time_point now, timeval &timeout) -> fd_set {
+  auto wait = std::chrono::seconds{timeout.tv_sec} + std::chrono::microseconds{timeout.tv_usec};
+
+  // throttled connections are left out until they earn tokens again
+  // so the peer is slowed down by tcp flow control instead of us buffering its data
+  auto cur_read_set = fd_set{};
+  FD_ZERO(&cur_read_set);
+  for (const auto sock : std::span{read_set.fd_array, read_set.fd_count}) {
+    if (auto it = net_entity->connections.find(sock); it != net_entity->connections.end()) {
+      auto &conn = it->second;
+      if (conn.stats.is_throttled) {
+        refill_buckets(conn, now);
+        const auto conn_wait = throttle_wait_time(conn);
+        if (conn_wait > std::chrono::microseconds{0}) {
+          wait = std::min(wait, conn_wait);
+          conn.stats.throttled_ticks += 1;
+          continue;
+        }
+        conn.stats.is_throttled = false;
+      }
+    }
+    FD_SET(sock, &cur_read_set);
+  }
+
+  // wake up when the first throttled connection can be read again
+  timeout = timeval{
+    .tv_sec = static_cast<long>(wait.count() / 1'000'000),
+    .tv_usec = static_cast<long>(wait.count() % 1'000'000),
+  };
+  return cur_read_set;
+}
+
+auto ConnectionHandler::refill_buckets(Connection &conn, std::chrono::steady_clock::time_point now) -> void {
+  // a zero burst would cap the bucket at nothing, so it never refills, allow one second worth instead
+  const auto burst_or_rate = [](double burst, double rate) { return burst > 0 ? burst : rate; };
+  conn.msg_bucket.refill(now, rate_limit.msgs_per_sec, burst_or_rate(rate_limit.msgs_burst, rate_limit.msgs_per_sec));
+  conn.byte_bucket.refill(now, rate_limit.bytes_per_sec,
+                          burst_or_rate(rate_limit.bytes_burst, rate_limit.bytes_per_sec));
+}
+
+auto ConnectionHandler::throttle_wait_time(const Connection &conn) const -> std::chrono::microseconds {
+  return std::max(conn.msg_bucket.wait_time(rate_limit.msgs_per_sec),
+                  conn.byte_bucket.wait_time(rate_limit.bytes_per_sec));
+}
+
+auto ConnectionHandler::is_overdrawn(const Connection &conn) const -> bool {
+  return (rate_limit.msgs_per_sec > 0 && conn.msg_bucket.tokens < 0) ||
+         (rate_limit.bytes_per_sec > 0 && conn.byte_bucket.tokens < 0);
+}
+
+auto ConnectionHandler::close_connection(Connection &conn) -> void {
+  conn.close();
+  FD_CLR(conn.socket, &read_set);
+  FD_CLR(conn.socket, &write_set);
+  FD_CLR(conn.socket, &err_set);
+}
+
+auto ConnectionHandler::end_connection(Connection &conn) -> void {
+  if (conn.session != nullptr) {
+    // keep the session so the client can resume it
+    conn.session->username = conn.username;
+    conn.session->socket = INVALID_SOCKET;
+    conn.session->detached_at = net_entity->transport->now();
+  } else if (conn.is_link && !conn.is_connecting) {
+    utils::log_info("link to node {:X} ({}) closed\n", conn.link_node_id, conn.ip);
+  } else if (conn.is_started) {
+    cb.on_conn_ended(net_entity, conn);
+  }
+
+  if (auto client = dynamic_cast<Client *>(net_entity)) {
+    if (client->connection == &conn) {
+      client->connection = nullptr;
+    }
+  }
+
+  const auto sock = conn.socket;
+  net_entity->connections.erase(sock);
+}
+
 auto ConnectionHandler::run(timeval timeout, bool &stop_flag) -> bool {
   while (!stop_flag) {
     if (!tick(timeout)) {
@@ -1,8 +1,13 @@
 #pragma once
 
+#include <set>
 #include <mutex>
 #include <span>
+#include <array>
+#include <deque>
 #include <queue>
+#include <atomic>
+#include <chrono>
 #include <vector>
 #include <string>
 #include <functional>
@@ -12,22 +17,86 @@
 #include <ws2tcpip.h>
 #include <mswsock.h>
 
+#include "capture.hpp"
+#include "buffer_pool.hpp"
+#include "executor.hpp"
+#include "handoff.hpp"
+#include "transport.hpp"
+
 namespace winnet {
 
 auto wsa_init() -> bool;
 
 auto wsa_deinit() -> bool;
 
+enum class PacketType : uint8_t {
+  data = 0,
+  session_data,   // body: uint64_t seq + data
+  session_hello,  // client -> server: start a new session
+  session_resume, // client -> server, body: uint64_t token + uint64_t last received seq
+  session_token,  // server -> client, body: uint64_t token + uint8_t resumed
+  session_ack,    // client -> server, body: uint64_t last received seq
+  batch,          // body: several complete packets back to back
+  capabilities,   // body: uint32_t capability flags of the sender
+  link_hello,     // server -> server, body: uint64_t node id of the sender + link secret
+  relay,          // server -> server, body: RelayHeader + message
+};
+
+// the peer understands batch packets
+inline constexpr uint32_t CAPABILITY_BATCH = 1u << 0;
+// what this build can receive, sent to the peer when a connection starts
+inline constexpr uint32_t LOCAL_CAPABILITIES = CAPABILITY_BATCH;
+
 #pragma pack(push, 1)
 struct PacketHeader {
   uint32_t packet_size;
+  PacketType packet_type;
+};
+
+// a broadcast passed between linked servers
+struct RelayHeader {
+  uint64_t origin_node; // node that published the message
+  uint64_t msg_id;      // unique per origin node
+  uint8_t hops;         // links crossed so far
 };
 #pragma pack(pop)
 
+// the packet buffer comes from `buffer_pool` when one is given
+auto make_packet(PacketType packet_type, const std::span<const std::span<const char>> parts,
+                 BufferPool *buffer_pool = nullptr) -> std::vector<char>;
+
+// lanes of a send queue, from most to least urgent
+enum class SendLane : uint8_t {
+  control, // protocol packets, always sent first
+  high,    // server notices
+  normal,  // chat messages, the only lane that is sequenced on a session
+  bulk,    // history catch-up and other large transfers
+};
+
+inline constexpr size_t SEND_LANE_COUNT = 4;
+
+struct SendSchedule {
+  // strict: always the most urgent non empty lane
+  // weighted: control is still strict, the other lanes take turns by weight so bulk never starves
+  bool is_strict;
+  std::array<uint32_t, SEND_LANE_COUNT> weights;
+};
+
+struct SendLaneStats {
+  size_t depth;
+  size_t peak_depth;
+  uint64_t sent;
+};
+
 struct SendQueue {
+  friend class Handoff;
+
 private:
   std::mutex mutex;
-  std::queue<std::vector<char>> queue;
+  std::array<std::queue<std::vector<char>>, SEND_LANE_COUNT> lanes;
+  std::array<SendLaneStats, SEND_LANE_COUNT> lane_stats;
+  // frames a lane can still send in the current weighted round
+  std::array<uint32_t, SEND_LANE_COUNT> credits;
 
 public:
   SendQueue();
@@ -36,24 +105,142 @@ public:
 
   auto is_empty() -> bool;
 
-  auto push_back(const std::vector<char> &data) -> void;
-  auto pop_front() -> std::vector<char>;
+  auto push_back(const std::vector<char> &data, SendLane lane = SendLane::normal) -> void;
+  auto push_back(std::vector<char> &&data, SendLane lane = SendLane::normal) -> void;
+  // only called between frames, so a frame that is partly sent is never interleaved
+  auto pop_front(const SendSchedule &schedule) -> std::vector<char>;
+  auto stats() -> std::array<SendLaneStats, SEND_LANE_COUNT>;
+};
+
+struct TokenBucket {
+  double tokens;
+  std::chrono::steady_clock::time_point last_refill;
+
+  auto refill(std::chrono::steady_clock::time_point now, double rate, double burst) -> void;
+  // time until there is at least one token, zero when there is one already
+  auto wait_time(double rate) const -> std::chrono::microseconds;
+};
+
+enum class RateLimitAction {
+  delay, // stop reading the connection until it has tokens again
+  drop,  // close the connection and end its session
+};
+
+// zero means unlimited, a zero burst with a nonzero rate means a burst of one second worth
+struct RateLimitPolicy {
+  double msgs_per_sec;
+  double msgs_burst;
+  double bytes_per_sec;
+  double bytes_burst;
+  // max bytes read from one connection in a single tick
+  uint32_t recv_budget;
+  RateLimitAction action;
+};
+
+struct ConnectionStats {
+  uint64_t recv_packets;
+  uint64_t recv_bytes;
+  uint64_t throttle_count;
+  uint64_t throttled_ticks;
+  bool is_throttled;
+};
+
+// resumable server side state of a client, outlives the connection it is attached to
+struct Session {
+  uint64_t token;
+  SOCKET socket; // INVALID_SOCKET while detached
+  std::string username;
+
+  uint64_t next_seq;
+  // session_data packets that are not acked yet, the front one has seq `next_seq - retransmit.size()`
+  std::deque<std::vector<char>> retransmit;
+  size_t retransmit_bytes;
+  size_t retransmit_capacity;
+  BufferPool *buffer_pool;
+
+  std::chrono::steady_clock::time_point detached_at;
+
+  auto front_seq() const -> uint64_t;
+  auto record(std::vector<char> packet) -> void;
+  auto ack(uint64_t seq) -> void;
+};
+
+struct ConnectionHandler;
+
+// a received message handed to the executor, it does not reference the connection
+// so it stays valid even if the connection is closed while the handler runs
+struct OffloadContext {
+  uint64_t conn_id;
+  SOCKET socket;
+  std::string username;
+  std::vector<char> data;
+  ConnectionHandler *handler;
+  // handed back to the io thread for on_recv_success, it only waits here behind earlier messages
+  bool is_pinned;
+
+  auto get_recv_string() const -> std::string;
+  // queued on the connection from the io thread, dropped if the connection is gone by then
+  auto send(const std::span<const char> data) -> void;
+  // run on the io thread, where connections can be used safely
+  auto post(std::function<void()> task) -> void;
+};
+
+// messages of one connection waiting for the executor, handled one at a time in order
+struct Strand {
+  std::mutex mutex;
+  std::deque<OffloadContext> queue;
+  bool is_scheduled;
 };
 
 struct Connection {
   friend struct ConnectionHandler;
+  friend class Server;
+  friend class Client;
+  friend class Handoff;
+
+private:
+  inline static std::atomic<uint64_t> next_id = 1;
 
 public:
+  uint64_t id; // unlike the socket this is never reused
   SOCKET socket;
   sockaddr_in addr_info;
   std::string ip;
   std::string username;
+  Session *session;
+  ConnectionStats stats;
+  // handle all of this connection's messages on the io thread even when the executor is enabled
+  // (ConnectionCallbacks::is_recv_pinned decides per message)
+  bool is_pinned;
+  // a link to another server, it only carries relayed broadcasts and is not a user
+  bool is_link;
+  uint64_t link_node_id;   // 0 until the link_hello of the other node arrives
+  std::string link_target; // "host:port" when this node dialed the link
+  bool is_connecting;      // a dialed link whose connect has not finished yet
 
 private:
+  TokenBucket msg_bucket;
+  TokenBucket byte_bucket;
+  std::shared_ptr<Strand> strand;
+  BufferPool *buffer_pool;
+  Transport *transport; // the one of the entity that owns the connection
+
+  uint32_t peer_capabilities;
+  // data packets are collected in batch_buf and queued as one batch packet by flush_batch
+  bool is_batching;
+  std::vector<char> batch_buf;
+  uint32_t batch_count;
+  std::chrono::steady_clock::time_point batch_started;
+
+  std::array<char, sizeof(PacketHeader)> recv_header;
+  // only holds a pooled buffer while a packet body is being received
   std::vector<char> recv_buf;
+  std::span<const char> recv_data;
   uint32_t recv_total_size;
   uint32_t cur_recv_amount;
   bool is_recv_header;
+  PacketType recv_packet_type;
+  bool is_started;
 
   SendQueue send_queue;
   std::vector<char> send_buf;
@@ -64,13 +251,45 @@ public:
   Connection(SOCKET socket, SOCKADDR_IN addr_info);
 
   auto close() -> void;
-  auto send(const std::span<const char> data) -> void;
+  // messages off the normal lane are not sequenced, so they are not replayed when a session resumes
+  auto send(const std::span<const char> data, SendLane lane = SendLane::normal) -> void;
+  auto send_packet(PacketType packet_type, const std::span<const std::span<const char>> parts) -> void;
+  auto send_packet(PacketType packet_type, const std::span<const std::span<const char>> parts, SendLane lane) -> void;
+  auto flush_batch() -> void;
+  // queue bytes that are already framed (one or more PacketHeader + body) as a single send
+  // the segments are gathered into one buffer instead of a vectored send: they usually point into a
+  // MessageHistory ring that keeps being overwritten while the send is still pending
+  auto send_framed(const std::span<const std::span<const char>> segments, SendLane lane = SendLane::normal) -> void;
+  auto send_lane_stats() -> std::array<SendLaneStats, SEND_LANE_COUNT>;
 
   auto get_recv_string() -> std::string;
   auto get_recv_bytes() -> std::vector<char>;
 };
 
-struct ConnectionHandler;
+// bounded ring of framed messages (PacketHeader + body) stored back to back in one buffer
+// when full the oldest messages are evicted, so the whole ring can be sent as one batch
+struct MessageHistory {
+private:
+  std::vector<char> ring;
+  size_t head;
+  size_t used;
+  size_t count;
+
+  auto copy_in(size_t offset, const std::span<const char> data) -> void;
+  auto copy_out(size_t offset, char *dst, size_t len) const -> void;
+
+public:
+  MessageHistory(size_t capacity);
+
+  auto capacity() const -> size_t;
+  auto size() const -> size_t;
+  auto size_bytes() const -> size_t;
+
+  auto clear() -> void;
+  auto push_back(const std::span<const char> data) -> bool;
+  // at most two segments because the stored frames can wrap around the end of the ring
+  auto snapshot() const -> std::array<std::span<const char>, 2>;
+};
 
 template <typename T>
 struct ConnectionCallbacks {
@@ -79,10 +298,17 @@ struct ConnectionCallbacks {
   std::function<void(T *, int)> on_conn_accept_error;
   std::function<void(T *, Connection &)> on_conn_started;
   std::function<void(T *, Connection &)> on_conn_ended;
+  std::function<void(T *, Connection &)> on_conn_throttled;
   std::function<void(T *, Connection &, int)> on_recv_error;
   std::function<void(T *, Connection &)> on_recv_success;
+  // called on an executor thread instead of on_recv_success when the executor is enabled
+  std::function<void(T *, OffloadContext &)> on_recv_offload;
+  // with the executor enabled, true keeps this message on the io thread (on_recv_success), still in order
+  std::function<bool(T *, Connection &)> is_recv_pinned;
   std::function<void(T *, Connection &, int)> on_send_error;
   std::function<void(T *, Connection &)> on_send_success;
+  // a message published on another node, called after it was sent to the local connections
+  std::function<void(T *, std::span<const char>)> on_relay;
 
   ConnectionCallbacks() {
     // clang-format off
@@ -91,10 +317,14 @@ struct ConnectionCallbacks {
     on_conn_accept_error = [](T *, int) {};
     on_conn_started = [](T *, Connection &) {};
     on_conn_ended = [](T *, Connection &) {};
+    on_conn_throttled = [](T *, Connection &) {};
     on_recv_error = [](T *, Connection &, int) {};
     on_recv_success = [](T *, Connection &) {};
+    on_recv_offload = [](T *, OffloadContext &) {};
+    is_recv_pinned = [](T *, Connection &) { return false; };
     on_send_error = [](T *, Connection &, int) {};
     on_send_success = [](T *, Connection &) {};
+    on_relay = [](T *, std::span<const char>) {};
     // clang-format on
   };
 };
@@ -106,11 +336,18 @@ public:
 
   ConnectionCallbacks<NetEntity> base_callbacks;
 
+  // packet buffers of all connections are recycled through this pool
+  BufferPool buffer_pool;
+
+  // socket calls and clock, winsock unless replaced before init/connect, must outlive the entity
+  Transport *transport;
+
   NetEntity();
   virtual ~NetEntity();
 
   std::unordered_map<SOCKET, Connection> connections;
 
+  // links to other servers are skipped, use Server::publish to reach their users too
   auto send_all(const std::span<const char> data) -> void;
   auto send_to(const std::span<SOCKET> targets, const std::span<const char> data) -> void;
   auto send_all_but(const std::span<SOCKET> ignore_targets, const std::span<const char> data) -> void;
@@ -121,6 +358,28 @@ public:
   SOCKET listen_socket;
   uint16_t port;
 
+  bool use_sessions;
+  size_t session_retransmit_capacity;
+  std::chrono::seconds session_expiry;
+  std::unordered_map<uint64_t, Session> sessions;
+
+  inline static uint8_t RELAY_MAX_HOPS = 8;
+  inline static size_t RELAY_DEDUP_CAPACITY = 4096;
+  inline static std::chrono::seconds LINK_RETRY_INTERVAL = std::chrono::seconds{5};
+
+  // random id of this server among the linked ones
+  uint64_t node_id;
+  uint64_t next_relay_id;
+  // (origin_node, msg_id) of recently relayed messages, a message reaching us over a second path is dropped
+  std::set<std::pair<uint64_t, uint64_t>> relay_seen;
+  std::deque<std::pair<uint64_t, uint64_t>> relay_seen_order;
+  // "host:port" of the servers this node keeps a link to, dialed again when the link drops
+  std::vector<std::string> link_targets;
+  std::chrono::steady_clock::time_point last_link_attempt;
+  // shared by the linked servers, a link_hello on a connection this node did not dial is refused
+  // (and the connection closed) unless it carries the same secret, so no inbound link is taken while it is empty
+  std::string link_secret;
+
   ConnectionCallbacks<Server> cb;
 
   Server();
@@ -128,12 +387,38 @@ public:
 
   auto init(uint16_t port) -> bool;
   auto listen() -> bool;
+  // clients that reconnect within `expiry` get the messages they missed replayed
+  // and keep their identity, `on_conn_started` is deferred until the client says hello
+  auto enable_sessions(size_t retransmit_capacity, std::chrono::seconds expiry) -> void;
+  auto create_session() -> Session &;
+
+  // keep a link to the server at `target` ("host:port"), the connection handler dials it
+  auto add_link(const std::string &target) -> void;
+  // only starts the connect, the connection handler finishes it (or drops the link) once select reports the socket
+  auto link(ConnectionHandler &connection_handler, const std::string &target) -> bool;
+  // send_all plus every user on the linked servers
+  auto publish(const std::span<const char> data) -> void;
+  auto publish_but(const std::span<SOCKET> ignore_targets, const std::span<const char> data) -> void;
+  // pass a message on to every link but `from`
+  auto relay(const RelayHeader &header, const std::span<const char> data, SOCKET from) -> void;
+  // false when the message was relayed here before
+  auto mark_relay_seen(uint64_t origin_node, uint64_t msg_id) -> bool;
 };
 
 class Client final : public NetEntity {
 public:
+  inline static uint64_t SESSION_ACK_INTERVAL = 16;
+  // messages that arrive slower than SESSION_ACK_INTERVAL are still acked this often
+  inline static std::chrono::milliseconds SESSION_ACK_IDLE_TIME = std::chrono::milliseconds{1000};
+
   Connection *connection;
 
+  bool use_sessions;
+  uint64_t session_token; // 0 when there is no session to resume
+  uint64_t session_recv_seq;
+  uint64_t session_unacked;
+  std::chrono::steady_clock::time_point last_session_ack;
+
   ConnectionCallbacks<Client> cb;
 
   Client();
@@ -141,6 +426,8 @@ public:
 
   auto connect(ConnectionHandler &connection_handler, std::string ip, std::string port) -> bool;
   auto disconnect(ConnectionHandler &connection_handler) -> void;
+  auto enable_sessions() -> void;
+  auto send_session_ack() -> void;
 };
 
 struct ConnectionHandler {
@@ -151,6 +438,31 @@ struct ConnectionHandler {
   fd_set write_set;
   fd_set err_set;
 
+  inline static size_t CAPTURE_INITIAL_SIZE = 16 * 1024 * 1024;
+
+  // every packet received and sent is appended here while it is open
+  CaptureLog capture;
+
+  RateLimitPolicy rate_limit;
+  SendSchedule send_schedule;
+
+  inline static size_t BATCH_MAX_SIZE = 64 * 1024;
+  // a header announcing a larger body ends the connection instead of allocating what it asks for
+  inline static size_t MAX_PACKET_SIZE = 1024 * 1024;
+  // the largest message that still fits MAX_PACKET_SIZE once it is numbered for a session or wrapped in a relay
+  static auto max_message_size() -> size_t;
+
+  bool use_batching;
+  std::chrono::microseconds batch_window;
+
+private:
+  std::mutex posted_mutex;
+  std::vector<std::function<void()>> posted;
+  std::atomic<size_t> offload_in_flight;
+  // declared after what its threads use so it is destroyed (and its threads joined) first
+  std::unique_ptr<Executor> executor;
+
+public:
   ConnectionHandler(NetEntity *net_entity);
 
   auto init() -> void;
@@ -158,6 +470,44 @@ struct ConnectionHandler {
   auto tick(timeval timeout) -> bool;
   auto run(timeval timeout, bool &stop_flag) -> bool;
   auto run(timeval timeout, std::atomic_bool &stop_flag) -> bool;
+  auto enable_capture(const std::string &path) -> bool;
+  auto disable_capture() -> void;
+  auto is_rate_limited() const -> bool;
+  // hand received messages to a thread pool so slow handlers do not block the io loop
+  auto enable_executor(size_t thread_count) -> void;
+  // run `task` on the io thread at the start of the next tick, safe to call from any thread
+  auto post(std::function<void()> task) -> void;
+  // pack messages queued to a connection within `window` (zero for one tick) into a single packet
+  // only for peers that announce CAPABILITY_BATCH
+  auto enable_batching(std::chrono::microseconds window) -> void;
+
+private:
+  std::chrono::steady_clock::time_point last_session_sweep;
+  std::chrono::steady_clock::time_point next_batch_flush;
+
+  auto handle_packet(Connection &conn, std::span<const char> body) -> void;
+  // append back to back packets to the capture, batches are unpacked one level deep
+  auto capture_sent(Connection &conn, std::span<const char> packets, bool is_outer) -> void;
+  auto dispatch_recv(Connection &conn) -> void;
+  auto run_strand(const std::shared_ptr<Strand> &strand) -> void;
+  auto run_pinned(const std::shared_ptr<Strand> &strand, OffloadContext &ctx) -> void;
+  auto run_posted() -> void;
+  auto flush_batches() -> void;
+  auto handle_session_packet(Server *server, Connection &conn, std::span<const char> body) -> void;
+  auto handle_relay(Server *server, Connection &conn, std::span<const char> body) -> void;
+  auto maintain_links(Server *server) -> void;
+  // a dialed link whose connect failed, maintain_links tries again later
+  auto drop_link_attempt(Connection &conn) -> void;
+  auto attach_session(Connection &conn, Session &session) -> void;
+  auto end_session(Server *server, Session &session) -> void;
+  auto expire_sessions(Server *server) -> void;
+  auto throttle_read_set(std::chrono::steady_clock::time_point now, timeval &timeout) -> fd_set;
+  auto refill_buckets(Connection &conn, std::chrono::steady_clock::time_point now) -> void;
+  auto throttle_wait_time(const Connection &conn) const -> std::chrono::microseconds;
+  // more was taken from a bucket than it held, what the drop policy disconnects for
+  auto is_overdrawn(const Connection &conn) const -> bool;
+  auto close_connection(Connection &conn) -> void;
+  auto end_connection(Connection &conn) -> void;
 };
 
 } // namespace winnet